@@ -92,7 +92,7 @@ void Aton::changePort(int port)
 
     try
     {
-        m_server.connect(port, true);
+        m_hub = FBAttach(this, port);
         m_legit = true;
     }
     catch ( ... )
@@ -107,28 +107,26 @@ void Aton::changePort(int port)
     }
 
     // Success
-    if (m_server.isConnected())
+    Thread::spawn(::FBUpdater, 1, this);
+    
+    // Update port in the UI
+    const int hubPort = m_hub->server.getPort();
+    if (m_port != hubPort)
     {
-        Thread::spawn(::FBWriter, 1, this);
-        Thread::spawn(::FBUpdater, 1, this);
-        
-        // Update port in the UI
-        if (m_port != m_server.getPort())
-        {
-            std::stringstream stream;
-            stream << (m_server.getPort());
-            std::string port = stream.str();
-            knob("port_number")->set_text(port.c_str());
-        }
+        std::stringstream stream;
+        stream << hubPort;
+        std::string port = stream.str();
+        knob("port_number")->set_text(port.c_str());
     }
 }
 
-// Disconnect the server for it's port
+// Leave the port, closing it if no other node listens on it
 void Aton::disconnect()
 {
-    if (m_server.isConnected())
+    if (m_hub != NULL)
     {
-        m_server.quit();
+        FBDetach(m_hub, this);
+        m_hub = NULL;
         Thread::wait(this);
     }
 }
@@ -142,7 +140,7 @@ void Aton::append(Hash& hash)
 void Aton::_validate(bool for_real)
 {
     // Do we need to open a port?
-    if (!m_node->m_server.isConnected() && !m_inError && m_legit)
+    if (m_node->m_hub == NULL && !m_inError && m_legit)
         changePort(m_port);
     
     // Handle any connection error
@@ -162,7 +160,8 @@ void Aton::_validate(bool for_real)
                       fB.getPRAM(),
                       fB.getTime(),
                       fB.getFrame(),
-                      fB.getAiVersionStr());
+                      fB.getAiVersionStr(),
+                      fB.getQuality());
             
             // Set the format
             const int width = fB.getWidth();
@@ -259,38 +258,147 @@ void Aton::_validate(bool for_real)
     info_.set(m_node->info().format());
 }
 
+// Buffer of channel z, looked up again only when its layer changes
+static int getChannelBuffer(FrameBuffer& fB, const Channel& z, const char*& layer, int& b)
+{
+    const char* name = getLayerName(z);
+    if (layer == NULL || strcmp(name, layer) != 0)
+    {
+        layer = name;
+        b = fB.getBufferIndex(z);
+    }
+    return b;
+}
+
+// Fill n pixels, stride floats apart
+static void fillRow(float* out, const int& n, const int& stride)
+{
+    if (stride == 1)
+        std::fill(out, out + n, 0.0f);
+    else
+        for (int i = 0; i < n; ++i, out += stride)
+            *out = 0.0f;
+}
+
+// Copy channel c of buffer b, pixels x to r of row y inside the buffer,
+// a tile at a time. Tiles never written are black.
+static void copyRow(const FrameBuffer& fB,
+                    const int& b,
+                    const int& c,
+                    const int& y,
+                    const int& x,
+                    const int& r,
+                    float* out,
+                    const int& stride)
+{
+    unsigned int xx = x;
+    while (xx < static_cast<unsigned int>(r))
+    {
+        unsigned int length;
+        const float* span = fB.getBufferSpan(b, xx, y, c, length);
+        length = std::min(length, r - xx);
+        
+        if (span == NULL)
+            fillRow(out, length, stride);
+        else if (stride == 1)
+            std::copy(span, span + length, out);
+        else
+            for (unsigned int i = 0; i < length; ++i)
+                out[i * stride] = span[i];
+        out += length * stride;
+        xx += length;
+    }
+}
+
+// Same for any pixels x to r of row y, out pointing to pixel x. Columns
+// outside the buffer are black, so rows and stripes that hang off it
+// come out the same.
+static void fetchRow(FrameBuffer& fB,
+                     const int& b,
+                     const int& c,
+                     const int& y,
+                     const int& x,
+                     const int& r,
+                     float* out,
+                     const int& stride)
+{
+    const int xx = std::min(std::max(x, 0), r);
+    const int rr = std::max(std::min(r, fB.getWidth()), xx);
+    fillRow(out, xx - x, stride);
+    copyRow(fB, b, c, y, xx, rr, out + (xx - x) * stride, stride);
+    fillRow(out + (rr - x) * stride, r - rr, stride);
+}
+
 void Aton::engine(int y, int x, int r, ChannelMask channels, Row& out)
 {
     const int f = getFrameIndex(m_node->m_frames, uiContext().frame());
     std::vector<FrameBuffer>& fBs = m_node->m_framebuffers;
     
+    // One lock and one bounds check for the whole row
+    ReadGuard lock(m_mutex);
+    if (fBs.empty() || !fBs[f].isReady() ||
+        y < 0 || y >= fBs[f].getHeight())
+    {
+        out.erase(channels);
+        return;
+    }
+    
+    FrameBuffer& fB = fBs[f];
+    const char* layer = NULL;
+    int b = 0;
+    
     foreach(z, channels)
     {
-        int b = 0;
-        int xx = x;
-        const int c = colourIndex(z);
-        float* cOut = out.writable(z) + x;
-        const float* END = cOut + (r - x);
+        // Channels of a layer come in a run
+        if (m_enable_aovs)
+            getChannelBuffer(fB, z, layer, b);
         
-        ReadGuard lock(m_mutex);
-        if (m_enable_aovs && !fBs.empty() && fBs[f].isReady())
-            b = fBs[f].getBufferIndex(z);
+        fetchRow(fB, b, colourIndex(z), y, x, r, out.writable(z) + x, 1);
+    }
+}
+
+#ifdef ATON_PLANAR
+// Fill a stripe of whole rows straight from the framebuffer, under a
+// single lock. What the buffer doesn't cover is black.
+void Aton::renderStripe(ImagePlane& plane)
+{
+    plane.makeWritable();
+    
+    const Box& box = plane.bounds();
+    const int width = box.r() - box.x();
+    const int stride = plane.colStride();
+    const int f = getFrameIndex(m_node->m_frames, uiContext().frame());
+    std::vector<FrameBuffer>& fBs = m_node->m_framebuffers;
+    
+    ReadGuard lock(m_mutex);
+    const bool ready = !fBs.empty() && fBs[f].isReady();
+    
+    // Rows of the stripe inside the buffer
+    const int y = ready ? std::max(box.y(), 0) : box.t();
+    const int t = ready ? std::min(box.t(), fBs[f].getHeight()) : box.t();
+    
+    const char* layer = NULL;
+    int b = 0;
+    
+    foreach(z, plane.channels())
+    {
+        if (ready && m_enable_aovs)
+            getChannelBuffer(fBs[f], z, layer, b);
+        
+        const int c = colourIndex(z);
+        const int chanNo = plane.chanNo(z);
         
-        while (cOut < END)
+        for (int row = box.y(); row < box.t(); ++row)
         {
-            if (fBs.empty() || !fBs[f].isReady() ||
-                x >= fBs[f].getWidth() ||
-                y >= fBs[f].getHeight() || r > fBs[f].getWidth())
-            {
-                *cOut = 0.0f;
-            }
+            float* out = &plane.writableAt(box.x(), row, chanNo);
+            if (row < y || row >= t)
+                fillRow(out, width, stride);
             else
-                *cOut = fBs[f].getBufferPix(b, xx, y, c);
-            ++cOut;
-            ++xx;
+                fetchRow(fBs[f], b, c, row, box.x(), box.r(), out, stride);
         }
     }
 }
+#endif
 
 void Aton::knobs(Knob_Callback f)
 {
@@ -301,6 +409,7 @@ void Aton::knobs(Knob_Callback f)
     
     // Main knobs
     Int_knob(f, &m_port, "port_number", "Port");
+    Knob* follow_knob = String_knob(f, &m_follow, "follow_knob", "Follow");
     Button(f, "clear_all_knob", "Clear All");
 
     Divider(f, "General");
@@ -309,6 +418,8 @@ void Aton::knobs(Knob_Callback f)
     Bool_knob(f, &m_multiframes, "multi_frame_knob", "Enable Multiple Frames");
     Newline(f);
     Knob* live_cam_knob = Bool_knob(f, &m_live_camera, "live_camera_knob", "Enable Live Camera");
+    Newline(f);
+    Knob* workers_knob = Int_knob(f, &m_ingest_workers, "ingest_workers_knob", "Ingest Workers");
 
     Divider(f, "Capture");
     Knob* limit_knob = Int_knob(f, &m_slimit, "limit_knob", "Limit");
@@ -339,6 +450,8 @@ void Aton::knobs(Knob_Callback f)
     limit_knob->set_flag(Knob::NO_RERENDER, true);
     path_knob->set_flag(Knob::NO_RERENDER, true);
     live_cam_knob->set_flag(Knob::NO_RERENDER, true);
+    workers_knob->set_flag(Knob::NO_RERENDER, true);
+    follow_knob->set_flag(Knob::NO_RERENDER, true);
     all_frames_knob->set_flag(Knob::NO_RERENDER, true);
     stamp_knob->set_flag(Knob::NO_RERENDER, true);
     stamp_scale_knob->set_flag(Knob::NO_RERENDER, true);
@@ -790,7 +903,8 @@ void Aton::setStatus(const long long& progress,
                      const long long& p_ram,
                      const int& time,
                      const double& frame,
-                     const char* version)
+                     const char* version,
+                     const int& quality)
 {
     const int hour = time / 3600000;
     const int minute = (time % 3600000) / 60000;
@@ -804,6 +918,13 @@ void Aton::setStatus(const long long& progress,
                                             "Progress: %s%%")%version%ram%p_ram
                                                              %hour%minute%second
                                                              %frame%f_count%progress).str();
+    
+    // Driver is holding back on a slow link
+    if (quality != QUALITY_FULL)
+        str_status += (boost::format(" | Link: %s")%qualityName(quality)).str();
+    
+    // Times the receive buffers grew for the last image, 0 in steady IPR
+    str_status += (boost::format(" | Allocations: %s")%m_node->m_allocations).str();
     knob("status_knob")->set_text(str_status.c_str());
 }
 
@@ -13,12 +13,27 @@ All rights reserved. See COPYING.txt for more details.
 #include "DDImage/Thread.h"
 #include "DDImage/Version.h"
 
+// Nuke 8 and later can also fetch whole stripes of the framebuffers,
+// define ATON_ROW_ENGINE to build the row engine alone
+#if kDDImageVersionMajorNum >= 8 && !defined(ATON_ROW_ENGINE)
+#define ATON_PLANAR
+#include "DDImage/PlanarIop.h"
+#endif
+
 using namespace DD::Image;
 
+#ifdef ATON_PLANAR
+typedef PlanarIop AtonIop;
+#else
+typedef Iop AtonIop;
+#endif
+
 #include "Data.h"
-#include "Server.h"
 #include "FrameBuffer.h"
 
+// Listening port, see FBWriter.h
+struct FBHub;
+
 // Class name
 static const char* const CLASS = "Aton";
 
@@ -29,17 +44,18 @@ static const char* const HELP =
     "For more info go to http://sosoyan.github.io/Aton/";
 
 // Nuke node
-class Aton: public Iop
+class Aton: public AtonIop
 {
     public:
         Aton*                     m_node;             // First node pointer
-        Server                    m_server;           // Aton::Server
+        FBHub*                    m_hub;              // Port shared with the other nodes
         ReadWriteLock             m_mutex;            // Mutex for locking the pixel buffer
         Format                    m_fmt;              // The nuke display format
         FormatPair                m_fmtp;             // Buffer format (knob)
         ChannelSet                m_channels;         // Channels aka AOVs object
         int                       m_port;             // Port we're listening on (knob)
         int                       m_slimit;           // The limit size
+        int                       m_ingest_workers;   // Threads writing the received pixels (knob)
         float                     m_cam_fov;          // Default Camera fov
         float                     m_cam_matrix;       // Default Camera matrix value
         bool                      m_multiframes;      // Enable Multiple Frames toogle
@@ -54,21 +70,25 @@ class Aton: public Iop
         double                    m_current_frame;    // Used to hold current frame
         double                    m_stamp_scale;      // Frame stamp size
         unsigned int              m_hash_count;       // Refresh hash counter
+        long long                 m_allocations;      // Receive buffer allocations of the last image
         const char*               m_path;             // Default path for Write node
         const char*               m_comment;          // Comment for the frame stamp
         std::string               m_node_name;        // Node name
+        std::string               m_follow;           // Node whose renders we show too (knob)
         std::string               m_status;           // Status bar text
         std::string               m_connectionError;  // Connection error report
         std::vector<double>       m_frames;           // Frames holder
         std::vector<FrameBuffer>  m_framebuffers;     // Framebuffers holder
         std::vector<std::string>  m_garbageList;      // List of captured files to be deleted
 
-        Aton(Node* node): Iop(node),
+        Aton(Node* node): AtonIop(node),
                           m_node(firstNode()),
+                          m_hub(NULL),
                           m_fmt(Format(0, 0, 1.0)),
                           m_channels(Mask_RGBA),
                           m_port(getPort()),
                           m_slimit(20),
+                          m_ingest_workers(2),
                           m_cam_fov(0),
                           m_cam_matrix(0),
                           m_multiframes(true),
@@ -82,8 +102,10 @@ class Aton: public Iop
                           m_legit(false),
                           m_current_frame(0),
                           m_stamp_scale(1.0),
+                          m_allocations(0),
                           m_path(""),
                           m_node_name(""),
+                          m_follow(""),
                           m_status(""),
                           m_comment(""),
                           m_connectionError("")
@@ -110,6 +132,14 @@ class Aton: public Iop
         void _validate(bool for_real);
 
         void engine(int y, int x, int r, ChannelMask channels, Row& out);
+    
+#ifdef ATON_PLANAR
+        void renderStripe(ImagePlane& plane);
+    
+        bool useStripes() const { return true; }
+    
+        PackedPreference packedPreference() const { return eUnpackedPreference; }
+#endif
 
         void knobs(Knob_Callback f);
 
@@ -144,7 +174,8 @@ class Aton: public Iop
                        const long long& p_ram = 0,
                        const int& time = 0,
                        const double& frame = 0,
-                       const char* version = "");
+                       const char* version = "",
+                       const int& quality = 0);
     
         void setCameraKnobs(const float& fov, const Matrix4& matrix);
     
@@ -5,37 +5,220 @@ All rights reserved. See COPYING.txt for more details.
 */
 
 #include "Client.h"
+#include <algorithm>
+#include <boost/array.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 using namespace boost::asio;
+using namespace boost::posix_time;
 
-Client::Client(std::string hostname, int port): mHost(hostname),
-                                                mPort(port),
-                                                mImageId(-1),
-                                                mSocket(mIoService)
+// Bucket messages up to this size are batched, until the batch reaches it
+static const size_t batchSize = 1 << 16;
+
+// Raw size of the pixels of all the planes in a strip of a big bucket
+static const size_t stripSize = 1 << 19;
+
+Client::Client(std::string hostname, int port, int capabilities): mHost(hostname),
+                                                                  mPort(port),
+                                                                  mImageId(-1),
+                                                                  mCapabilities(capabilities),
+                                                                  mNegotiated(0),
+                                                                  mVersion(0),
+                                                                  mIsConnected(false),
+                                                                  mIsResolved(false),
+                                                                  mLayout(0),
+                                                                  mSession(0),
+                                                                  mStream(0),
+                                                                  mStreams(1),
+                                                                  mSequence(0),
+                                                                  mSocket(mIoService)
 {
 }
 
-void Client::connect(std::string hostname, int port)
+void Client::connect()
 {
     using boost::asio::ip::tcp;
-    tcp::resolver resolver(mIoService);
-    tcp::resolver::query query(hostname.c_str(), boost::lexical_cast<std::string>(port).c_str());
-    tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-    tcp::resolver::iterator end;
     boost::system::error_code error = boost::asio::error::host_not_found;
-    while (error && endpoint_iterator != end)
+
+    // Try the endpoint that worked last time first
+    if (mIsResolved)
     {
         mSocket.close();
-        mSocket.connect(*endpoint_iterator++, error);
+        mSocket.connect(mEndpoint, error);
+    }
+    
+    // Resolve the host only when we have to
+    if (error)
+    {
+        tcp::resolver resolver(mIoService);
+        tcp::resolver::query query(mHost.c_str(), boost::lexical_cast<std::string>(mPort).c_str());
+        tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
+        tcp::resolver::iterator end;
+        while (error && endpoint_iterator != end)
+        {
+            mEndpoint = *endpoint_iterator++;
+            mSocket.close();
+            mSocket.connect(mEndpoint, error);
+        }
     }
+    
+    mIsResolved = !error;
     if (error)
         throw boost::system::system_error(error);
+    
+    mSocket.set_option(tcp::no_delay(true));
+    mIsConnected = true;
+}
+
+void Client::handshake()
+{
+    // Pixels can skip the network when the Server is on this host
+    int capabilities = mCapabilities;
+    if (isLocal())
+        capabilities |= CAP_SHM;
+    
+    // Tell the Server which stream of the render this is
+    if (mStreams > 1)
+        capabilities |= CAP_STREAMS;
+    
+    int key = 3;
+    std::vector<const_buffer> message;
+    message.push_back(buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&capabilities), sizeof(int)));
+    if (capabilities & CAP_STREAMS)
+    {
+        message.push_back(buffer(reinterpret_cast<char*>(&mSession), sizeof(long long)));
+        message.push_back(buffer(reinterpret_cast<char*>(&mStream), sizeof(int)));
+        message.push_back(buffer(reinterpret_cast<char*>(&mStreams), sizeof(int)));
+    }
+    write(mSocket, message);
+    
+    // Once per connection, not per image
+    read(mSocket, buffer(reinterpret_cast<char*>(&mNegotiated), sizeof(int)));
+    mNegotiated &= capabilities;
+    
+    if (mStreams > 1 && !(mNegotiated & CAP_STREAMS))
+        throw std::runtime_error("Server can't receive parallel streams!");
+    
+    // Settle on the newest version we both speak
+    mVersion = 0;
+    if (mNegotiated & CAP_VERSION)
+    {
+        int version;
+        read(mSocket, buffer(reinterpret_cast<char*>(&version), sizeof(int)));
+        mVersion = std::min(version, protocolVersion);
+        write(mSocket, buffer(reinterpret_cast<char*>(&mVersion), sizeof(int)));
+    }
+    if (mVersion < 1)
+        mNegotiated &= ~(CAP_BATCH | CAP_STRIPS);
+    
+    // Map the Server's Ring and tell it whether we are going to use it
+    if (mNegotiated & CAP_SHM)
+    {
+        int name_size;
+        read(mSocket, buffer(reinterpret_cast<char*>(&name_size), sizeof(int)));
+        std::vector<char> name(name_size);
+        read(mSocket, buffer(name));
+        
+        int use_ring = mRing.open(std::string(name.begin(), name.end()));
+        write(mSocket, buffer(reinterpret_cast<char*>(&use_ring), sizeof(int)));
+        if (!use_ring)
+            mNegotiated &= ~CAP_SHM;
+    }
+}
+
+bool Client::isLocal()
+{
+    boost::system::error_code error;
+    const ip::address remote = mSocket.remote_endpoint(error).address();
+    if (error)
+        return false;
+    
+    const ip::address local = mSocket.local_endpoint(error).address();
+    return !error && (remote.is_loopback() || remote == local);
+}
+
+template <typename Buffers>
+void Client::send(const Buffers& buffers)
+{
+    if (!mRing.isOpen())
+    {
+        write(mSocket, buffers);
+        return;
+    }
+    
+    typename Buffers::const_iterator it;
+    for (it = buffers.begin(); it != buffers.end(); ++it)
+        sendToRing(buffer_cast<const char*>(*it), buffer_size(*it));
+}
+
+void Client::sendToRing(const char* data, size_t size)
+{
+    int idle = 0;
+    while (size > 0)
+    {
+        const size_t n = mRing.write(data, size);
+        data += n;
+        size -= n;
+        
+        if (n > 0)
+            idle = 0;
+        else
+        {
+            // Server is behind, make sure it is still there while we wait
+            if (++idle % 64 == 0 && !isAlive())
+                throw std::runtime_error("Lost connection to the Server!");
+            mRing.waitToWrite(idle);
+        }
+    }
+}
+
+void Client::frame(std::vector<const_buffer>& message, int& length)
+{
+    if (mVersion < 1)
+        return;
+    
+    length = static_cast<int>(buffer_size(message) - sizeof(int));
+    message.insert(message.begin() + 1, buffer(reinterpret_cast<char*>(&length), sizeof(int)));
+}
+
+void Client::flush()
+{
+    if (mBatch.empty())
+        return;
+    
+    int key = 4;
+    int length = static_cast<int>(mBatch.size());
+    boost::array<const_buffer, 3> message = {{
+        buffer(reinterpret_cast<char*>(&key), sizeof(int)),
+        buffer(reinterpret_cast<char*>(&length), sizeof(int)),
+        buffer(mBatch)
+    }};
+    mBatch.clear();
+    send(message);
 }
 
 void Client::disconnect()
 {
+    mRing.close();
     mSocket.close();
+    mIsConnected = false;
+}
+
+bool Client::isAlive()
+{
+    if (!mIsConnected)
+        return false;
+    
+    // Server never writes to us, so anything readable means it went away
+    char c;
+    boost::system::error_code error;
+    mSocket.non_blocking(true);
+    mSocket.read_some(buffer(&c, 1), error);
+    mSocket.non_blocking(false);
+
+    return error == boost::asio::error::would_block;
 }
 
 Client::~Client()
@@ -45,26 +228,134 @@ Client::~Client()
 
 void Client::openImage(Data& header)
 {
-    // Connect to port!
-    connect(mHost, mPort);
+    // Reconnect only if we lost the Server since the last image
+    if (!isAlive())
+    {
+        disconnect();
+        connect();
+        handshake();
+        
+        // Server might not have anything of what we sent before
+        mHashes.clear();
+        mBatch.clear();
+    }
+    flush();
+    
+    // Buckets of the previous image are only worth comparing against if
+    // they land on the same buffers
+    unsigned long long layout = Codec::hash(&header.mXres, sizeof(int));
+    layout = Codec::hash(&header.mYres, sizeof(int), layout);
+    layout = Codec::hash(&header.mCurrentFrame, sizeof(float), layout);
+    std::vector<Aov>::const_iterator it;
+    for (it = header.mAovs.begin(); it != header.mAovs.end(); ++it)
+    {
+        layout = Codec::hash(it->name.c_str(), it->name.size(), layout);
+        layout = Codec::hash(&it->spp, sizeof(int), layout);
+    }
+    if (layout != mLayout)
+    {
+        mHashes.clear();
+        mLayout = layout;
+    }
 
+    // We are numbering our own images, so no need to wait for the Server.
+    // Each one is a new generation, its buckets replace the ones of the
+    // images before it.
+    mImageId = mImageId < 0 ? 1 : mImageId + 1;
+    nextSequence(header.mSequence);
+    
     // Send image header message with image desc information
     int key = 0;
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    const int camMatrixSize = 16;
+    int aov_count = static_cast<int>(header.mAovs.size());
+    std::vector<const_buffer> message;
+    message.push_back(buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&mSequence), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mXres), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mYres), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mRArea), sizeof(long long)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mVersion), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mCurrentFrame), sizeof(float)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mCamFov), sizeof(float)));
+    message.push_back(buffer(reinterpret_cast<char*>(&header.mCamMatrix[0]), sizeof(float)*camMatrixSize));
     
-    // Read our imageid
-    read(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    // Region of the image this render covers
+    if (mNegotiated & CAP_REGION)
+    {
+        message.push_back(buffer(reinterpret_cast<char*>(&header.mBucket_xo), sizeof(int)));
+        message.push_back(buffer(reinterpret_cast<char*>(&header.mBucket_yo), sizeof(int)));
+        message.push_back(buffer(reinterpret_cast<char*>(&header.mBucket_size_x), sizeof(int)));
+        message.push_back(buffer(reinterpret_cast<char*>(&header.mBucket_size_y), sizeof(int)));
+    }
     
-    // Send our width & height
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mXres), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mYres), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mRArea), sizeof(long long)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mVersion), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mCurrentFrame), sizeof(float)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mCamFov), sizeof(float)));
+    // Node it goes to
+    int target_size = static_cast<int>(header.mTarget.size());
+    if (mNegotiated & CAP_TARGET)
+    {
+        message.push_back(buffer(reinterpret_cast<char*>(&target_size), sizeof(int)));
+        message.push_back(buffer(header.mTarget));
+    }
     
-    const int camMatrixSize = 16;
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mCamMatrix[0]), sizeof(float)*camMatrixSize));
+    // Followed by the AOV dictionary, buckets refer to AOVs by index
+    std::vector<int> name_sizes(aov_count);
+    message.push_back(buffer(reinterpret_cast<char*>(&aov_count), sizeof(int)));
+    for (int i = 0; i < aov_count; ++i)
+    {
+        const Aov& aov = header.mAovs[i];
+        name_sizes[i] = static_cast<int>(aov.name.size()) + 1;
+        message.push_back(buffer(reinterpret_cast<const char*>(&aov.spp), sizeof(int)));
+        message.push_back(buffer(reinterpret_cast<char*>(&name_sizes[i]), sizeof(int)));
+        message.push_back(buffer(aov.name.c_str(), name_sizes[i]));
+    }
+    
+    int length;
+    frame(message, length);
+    send(message);
+}
+
+void Client::addPayload(const float* pixels,
+                        const int& num_samples,
+                        const int& spp,
+                        PlaneHeader& header,
+                        const size_t& slot)
+{
+    const size_t raw_size = sizeof(float) * num_samples;
+    const int& precision = header.precision;
+    
+    const ptime start = microsec_clock::universal_time();
+    
+    const char* packed = reinterpret_cast<const char*>(pixels);
+    size_t packed_size = raw_size;
+    if (precision != Codec::Float)
+    {
+        mCodec.pack(pixels, num_samples, spp, precision, mPacked[slot]);
+        packed = &mPacked[slot][0];
+        packed_size = mPacked[slot].size();
+    }
+    
+    // Compress the pixels if the Server agreed to it
+    int codec = Codec::Raw;
+    if (mNegotiated & CAP_COMPRESSION)
+    {
+        const size_t type_size = Codec::typeSize(precision);
+        codec = mCodec.encode(packed, packed_size, type_size,
+                              type_size * spp, mPayload[slot]);
+    }
+    const_buffer payload = codec == Codec::Raw ? const_buffer(packed, packed_size) :
+                                                 const_buffer(&mPayload[slot][0], mPayload[slot].size());
+    
+    if (mNegotiated)
+    {
+        const double us = static_cast<double>((microsec_clock::universal_time() - start).total_microseconds());
+        mStats.add(raw_size, buffer_size(payload), us);
+    }
+    
+    header.codec = codec;
+    header.payloadSize = static_cast<int>(buffer_size(payload));
+    
+    mMessage.push_back(buffer(reinterpret_cast<const char*>(&header), sizeof(PlaneHeader)));
+    mMessage.push_back(payload);
 }
 
 void Client::sendPixels(Data& data)
@@ -74,52 +365,206 @@ void Client::sendPixels(Data& data)
         throw std::runtime_error("Could not send data - image id is not valid!");
     }
 
-    // Send data for image_id
-    int key = 1;
+    const size_t plane_count = data.mPlanes.size();
     
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
-
-    // Get size of aov name
-    size_t aov_size = strlen(data.mAovName) + 1;
-
-    // Get size of overall samples
-    const int num_samples = data.mBucket_size_x * data.mBucket_size_y * data.mSpp;
-    
-    // Sending data to buffer
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mXres), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mYres), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mBucket_xo), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mBucket_yo), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mBucket_size_x), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mBucket_size_y), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mRArea), sizeof(long long)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mVersion), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mCurrentFrame), sizeof(float)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mSpp), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mRam), sizeof(long long)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mTime), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
-    write(mSocket, buffer(data.mAovName, aov_size));
-    write(mSocket, buffer(reinterpret_cast<char*>(&data.mpData[0]), sizeof(float)*num_samples));
-}
-
-void Client::closeImage()
+    // Subsampled planes go as they are if the Server can expand them,
+    // we fill them back to full size otherwise
+    int step = std::max(data.mSubsample, 1);
+    const bool expand = step > 1 && !(mNegotiated & CAP_SUBSAMPLE);
+    if (expand)
+        step = 1;
+    
+    const int width = Codec::subsampledSize(data.mBucket_size_x, step);
+    const int num_pixels = width * Codec::subsampledSize(data.mBucket_size_y, step);
+    
+    // Rows that make about a strip, on sampled rows
+    int strip_rows = data.mBucket_size_y;
+    if (mNegotiated & CAP_STRIPS)
+    {
+        size_t row_size = 0;
+        for (size_t i = 0; i < plane_count; ++i)
+            row_size += sizeof(float) * width * data.mPlanes[i].spp;
+        if (row_size > 0 && stripSize / row_size * step < static_cast<size_t>(data.mBucket_size_y))
+            strip_rows = std::max(static_cast<int>(stripSize / row_size) * step, step);
+    }
+    const size_t strips = strip_rows < data.mBucket_size_y ?
+                          Codec::subsampledSize(data.mBucket_size_y, strip_rows) : 1;
+    
+    if (mPacked.size() < plane_count * strips)
+    {
+        mPacked.resize(plane_count * strips);
+        mPayload.resize(plane_count * strips);
+    }
+    if (mExpanded.size() < plane_count)
+        mExpanded.resize(plane_count);
+    mPlaneHeaders.resize(plane_count * strips);
+    
+    // Pack the header for image_id
+    BucketHeader header;
+    header.key = strips > 1 ? 5 : 1;
+    header.imageId = mImageId;
+    header.sequence = nextSequence(data.mSequence);
+    header.xres = data.mXres;
+    header.yres = data.mYres;
+    header.bucket_xo = data.mBucket_xo;
+    header.bucket_yo = data.mBucket_yo;
+    header.bucket_size_x = data.mBucket_size_x;
+    header.bucket_size_y = data.mBucket_size_y;
+    header.rArea = data.mRArea;
+    header.version = data.mVersion;
+    header.currentFrame = data.mCurrentFrame;
+    header.ram = data.mRam;
+    header.time = data.mTime;
+    header.quality = data.mQuality;
+    header.subsample = step;
+    header.planeCount = static_cast<int>(plane_count);
+    
+    std::vector<const_buffer>& message = mMessage;
+    message.clear();
+    message.push_back(buffer(reinterpret_cast<const char*>(&header.key), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<const char*>(&header) + sizeof(int), sizeof(BucketHeader) - sizeof(int)));
+    if (strips > 1)
+        message.push_back(buffer(reinterpret_cast<const char*>(&strip_rows), sizeof(int)));
+    
+    // Settle the precision of every plane, and leave out the ones the
+    // Server got last time
+    for (size_t i = 0; i < plane_count; ++i)
+    {
+        const Plane& plane = data.mPlanes[i];
+        
+        const float* pixels = plane.data;
+        if (expand)
+        {
+            mExpanded[i].resize(num_pixels * plane.spp);
+            Codec::expand(plane.data, data.mBucket_size_x, data.mBucket_size_y,
+                          plane.spp, data.mSubsample, &mExpanded[i][0]);
+            pixels = &mExpanded[i][0];
+        }
+        
+        // Lower the precision only if the Server can expand it back
+        int precision = plane.precision;
+        if ((precision == Codec::Half && !(mNegotiated & CAP_HALF)) ||
+            (precision == Codec::Preview && !(mNegotiated & CAP_PREVIEW)))
+            precision = Codec::Float;
+        
+        PlaneHeader& plane_header = mPlaneHeaders[i];
+        plane_header.aov = plane.aov;
+        plane_header.precision = precision;
+        plane_header.codec = Codec::Raw;
+        plane_header.payloadSize = 0;
+        
+        // Skip the pixels if the Server got the same ones last time
+        if (mNegotiated & CAP_UNCHANGED)
+        {
+            const size_t raw_size = sizeof(float) * num_pixels * plane.spp;
+            
+            // The Server may have kept the strips of a bucket it skipped
+            const int bucket[6] = { data.mBucket_size_x, data.mBucket_size_y,
+                                    plane.spp, precision, step, strip_rows };
+            const unsigned long long seed = Codec::hash(bucket, sizeof(bucket));
+            const unsigned long long hash = Codec::hash(pixels, raw_size, seed);
+            
+            const long long key = (static_cast<long long>(plane.aov) << 42) |
+                                  (static_cast<long long>(data.mBucket_xo & 0x1fffff) << 21) |
+                                  (data.mBucket_yo & 0x1fffff);
+            
+            unsigned long long& previous = mHashes[key];
+            if (previous == hash)
+            {
+                plane_header.codec = Codec::Unchanged;
+                mStats.addUnchanged(raw_size);
+            }
+            previous = hash;
+        }
+    }
+    
+    // Planes of each strip in turn
+    for (size_t s = 0; s < strips; ++s)
+    {
+        const int row = static_cast<int>(s) * strip_rows;
+        const int rows = std::min(strip_rows, data.mBucket_size_y - row);
+        const int offset = width * (row / step);
+        const int strip_pixels = width * Codec::subsampledSize(rows, step);
+        
+        for (size_t i = 0; i < plane_count; ++i)
+        {
+            const Plane& plane = data.mPlanes[i];
+            const size_t slot = s * plane_count + i;
+            PlaneHeader& plane_header = mPlaneHeaders[slot];
+            if (s > 0)
+                plane_header = mPlaneHeaders[i];
+            
+            if (plane_header.codec == Codec::Unchanged)
+            {
+                message.push_back(buffer(reinterpret_cast<const char*>(&plane_header), sizeof(PlaneHeader)));
+                continue;
+            }
+            
+            const float* pixels = expand ? &mExpanded[i][0] : plane.data;
+            addPayload(pixels + offset * plane.spp, strip_pixels * plane.spp,
+                       plane.spp, plane_header, slot);
+        }
+    }
+    
+    int length;
+    frame(message, length);
+    
+    // Small buckets wait to go out with the next ones, they don't need
+    // a write of their own
+    const size_t size = buffer_size(message);
+    if ((mNegotiated & CAP_BATCH) && !mRing.isOpen() && size < batchSize / 4)
+    {
+        std::vector<const_buffer>::const_iterator it;
+        for (it = message.begin(); it != message.end(); ++it)
+        {
+            const char* data = buffer_cast<const char*>(*it);
+            mBatch.insert(mBatch.end(), data, data + buffer_size(*it));
+        }
+        if (mBatch.size() >= batchSize)
+            flush();
+        return;
+    }
+    
+    // Send header and all the planes with one gathered write
+    flush();
+    send(message);
+}
+
+void Client::closeImage(const int& sequence)
 {
+    flush();
+    nextSequence(sequence);
+    
     // Send image complete message for image_id
     int key = 2;
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    std::vector<const_buffer> message;
+    message.push_back(buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    message.push_back(buffer(reinterpret_cast<char*>(&mSequence), sizeof(int)));
+    
+    int length;
+    frame(message, length);
+    send(message);
+}
 
-    // Tell the server which image we're closing
-    write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+void Client::setStream(const long long& session,
+                       const int& stream,
+                       const int& streams)
+{
+    mSession = session;
+    mStream = stream;
+    mStreams = streams;
+}
 
-    // Disconnect from port!
-    disconnect();
+const int& Client::nextSequence(const int& sequence)
+{
+    mSequence = sequence > 0 ? sequence : mSequence + 1;
+    return mSequence;
 }
 
 void Client::quit()
 {
-    connect(mHost, mPort);
+    connect();
     int key = 9;
     write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
     disconnect();
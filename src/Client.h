@@ -8,52 +8,147 @@ All rights reserved. See COPYING.txt for more details.
 #define ATON_CLIENT_H_
 
 #include "Data.h"
+#include "Codec.h"
+#include "Ring.h"
+#include <map>
 #include <boost/asio.hpp>
 
 // Used to send an image to a Server
-// The Client class is created each time an application wants to send
-// an image to the Server. Once it is instantiated the application should
-// call openImage(), send(), and closeImage() to send an image to the Server
+// The Client class is created once by an application that wants to send
+// images to the Server and keeps its connection open between images.
+// For every image the application should call openImage(), sendPixels()
+// and closeImage(); the open and close are sent in-band on the same
+// connection, so pixels can follow them without waiting for a reply.
+// When the Server runs on the same host the messages go through a shared
+// memory Ring instead of the socket, which then only tells whether the
+// Server is still there. Buckets whose pixels didn't change since the
+// previous image are replaced by a marker, the Server keeps what it has.
 class Client
 {
 friend class Server;
 public:
     // Creates a new Client object and tell it to connect any messages to
-    // the specified host/port
-    Client(std::string hostname, int port);
+    // the specified host/port. capabilities is a mask of Capability flags
+    // to ask the Server for every time we connect.
+    Client(std::string hostname, int port, int capabilities = 0);
 
     ~Client();
 
     // Sends a message to the Server to open a new image
     // The header parameter is used to tell the Server the size of image
-    // buffer to allocate.
+    // buffer to allocate, and the AOVs the buckets will refer to.
     void openImage(Data& header);
     
     // Sends a section of image data to the Server
     // Once an image is open a Client can use this to send a series of
     // pixel blocks to the Server. The Data object passed must correctly
     // specify the block position and dimensions as well as provide a
-    // pointer to pixel data.
+    // plane of pixel data for every AOV of the bucket, which all go out
+    // as one message. Big buckets go in row strips if the Server can take
+    // them, so it can show the first rows while the others arrive.
     void sendPixels(Data& data);
 
     // Sends a message to the Server that the Clients has finished
     // This tells the Server that a Client has finished sending pixel
-    // information for an image.
-    void closeImage();
+    // information for an image. The connection stays open for the next one.
+    void closeImage(const int& sequence = 0);
+    
+    // Sends the buckets held back to go out together, with CAP_BATCH.
+    // Image open and close send them too.
+    void flush();
+    
+    // Makes this Client one of several streams sending the same render
+    // Has to be called before the first image. Open and close messages
+    // should go through all the streams with the same sequence numbers.
+    void setStream(const long long& session,
+                   const int& stream,
+                   const int& streams);
+    
+    // Host and port this Client sends its images to
+    const std::string& host() const { return mHost; }
+    const int& port() const { return mPort; }
+    
+    // Capabilities asked for and the ones the Server agreed to
+    const int& capabilities() const { return mCapabilities; }
+    const int& negotiated() const { return mNegotiated; }
+    
+    // Protocol version agreed with the Server
+    const int& version() const { return mVersion; }
+    
+    // Precision and compression statistics of the pixels sent since resetStats()
+    const CodecStats& stats() const { return mStats; }
+    void resetStats() { mStats.reset(); }
     
 private:
-    void connect(std::string host, int port);
+    void connect();
     void disconnect();
     void quit();
+    
+    // Agrees on the capabilities with the Server
+    void handshake();
+    
+    // Whether the Server is on this host
+    bool isLocal();
+    
+    // Sends a sequence of buffers through the Ring if we have one,
+    // or the socket otherwise
+    template <typename Buffers>
+    void send(const Buffers& buffers);
+    void sendToRing(const char* data, size_t size);
+    
+    // Packs and compresses num_samples samples of a plane into the
+    // buffers of slot, and adds them to the bucket message after header
+    void addPayload(const float* pixels,
+                    const int& num_samples,
+                    const int& spp,
+                    PlaneHeader& header,
+                    const size_t& slot);
+    
+    // Puts the size of a message after its key, from version 1 on
+    void frame(std::vector<boost::asio::const_buffer>& message, int& length);
+    
+    // Checks that the Server hasn't closed the connection on us
+    bool isAlive();
+    
+    // Numbers the next message, unless it has been numbered already
+    const int& nextSequence(const int& sequence);
 
     // Store the port we should connect to
     std::string mHost;
     int mPort, mImageId;
-    bool mIsConnected;
+    int mCapabilities, mNegotiated, mVersion;
+    bool mIsConnected, mIsResolved;
+    
+    // Pixel precision and compression
+    Codec mCodec;
+    CodecStats mStats;
+    std::vector<std::vector<char> > mPacked, mPayload;
+    std::vector<std::vector<float> > mExpanded;
+    
+    // Hashes of the pixels the Server has, per bucket and AOV, and of
+    // the image they belong to
+    std::map<long long, unsigned long long> mHashes;
+    unsigned long long mLayout;
+    
+    // Stream of a session, and the last message number
+    long long mSession;
+    int mStream, mStreams, mSequence;
+    
+    // Bucket message, reused between buckets, with a plane header per
+    // AOV and strip
+    std::vector<PlaneHeader> mPlaneHeaders;
+    std::vector<boost::asio::const_buffer> mMessage;
+    
+    // Bucket messages waiting to go out together
+    std::vector<char> mBatch;
+    
+    // Local transport
+    Ring mRing;
 
     // TCP stuff
     boost::asio::io_service mIoService;
     boost::asio::ip::tcp::socket mSocket;
+    boost::asio::ip::tcp::endpoint mEndpoint;
 };
 
 #endif // ATON_CLIENT_H_
@@ -0,0 +1,549 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "Codec.h"
+#include <cstring>
+#include <algorithm>
+
+// Match finder size and limits of the LZ stage
+static const int hashBits = 14;
+static const size_t minMatch = 4;
+static const size_t maxOffset = 65535;
+
+// Writes the part of a length that doesn't fit into a token nibble
+static bool writeLength(unsigned char*& op, const unsigned char* end, size_t length)
+{
+    while (length >= 255)
+    {
+        if (op == end)
+            return false;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op == end)
+        return false;
+    *op++ = static_cast<unsigned char>(length);
+    return true;
+}
+
+// Reads the part of a length that didn't fit into a token nibble
+static bool readLength(const unsigned char*& ip, const unsigned char* end, size_t& length)
+{
+    unsigned char b;
+    do
+    {
+        if (ip == end)
+            return false;
+        b = *ip++;
+        length += b;
+    }
+    while (b == 255);
+    return true;
+}
+
+// Writes one sequence: a run of literals followed by a match, if any
+static bool writeSequence(unsigned char*& op,
+                          const unsigned char* end,
+                          const unsigned char* literals,
+                          const size_t& litLength,
+                          const size_t& offset,
+                          const size_t& matchLength)
+{
+    if (op == end)
+        return false;
+
+    const size_t matchCode = matchLength ? matchLength - minMatch : 0;
+    unsigned char* token = op++;
+    *token = static_cast<unsigned char>((std::min<size_t>(litLength, 15) << 4) |
+                                         std::min<size_t>(matchCode, 15));
+
+    if (litLength >= 15 && !writeLength(op, end, litLength - 15))
+        return false;
+
+    if (static_cast<size_t>(end - op) < litLength)
+        return false;
+    memcpy(op, literals, litLength);
+    op += litLength;
+
+    // Last sequence has no match
+    if (matchLength == 0)
+        return true;
+
+    if (end - op < 2)
+        return false;
+    *op++ = static_cast<unsigned char>(offset & 0xff);
+    *op++ = static_cast<unsigned char>(offset >> 8);
+
+    if (matchCode >= 15 && !writeLength(op, end, matchCode - 15))
+        return false;
+
+    return true;
+}
+
+// IEEE half conversions, rounding to nearest even
+// Based on Fabian Giesen's public domain float/half routines.
+union FloatBits
+{
+    float f;
+    unsigned int u;
+};
+
+static unsigned short floatToHalf(const float& value)
+{
+    FloatBits f;
+    f.f = value;
+    const unsigned int sign = f.u & 0x80000000u;
+    f.u ^= sign;
+
+    unsigned int h;
+    if (f.u >= (127u + 16u) << 23) // Inf or NaN
+    {
+        h = f.u > 255u << 23 ? 0x7e00 : 0x7c00;
+    }
+    else if (f.u < 113u << 23) // Subnormal or zero
+    {
+        FloatBits magic;
+        magic.u = ((127 - 15) + (23 - 10) + 1) << 23;
+        f.f += magic.f;
+        h = f.u - magic.u;
+    }
+    else
+    {
+        const unsigned int odd = (f.u >> 13) & 1;
+        f.u += (static_cast<unsigned int>(15 - 127) << 23) + 0xfff + odd;
+        h = f.u >> 13;
+    }
+    return static_cast<unsigned short>(h | (sign >> 16));
+}
+
+static float halfToFloat(const unsigned short& value)
+{
+    const unsigned int shiftedExp = 0x7c00 << 13;
+
+    FloatBits f;
+    f.u = (value & 0x7fff) << 13;
+    const unsigned int exp = shiftedExp & f.u;
+    f.u += (127 - 15) << 23;
+
+    if (exp == shiftedExp) // Inf or NaN
+        f.u += (128 - 16) << 23;
+    else if (exp == 0) // Subnormal or zero
+    {
+        FloatBits magic;
+        magic.u = 113 << 23;
+        f.u += 1 << 23;
+        f.f -= magic.f;
+    }
+    f.u |= (value & 0x8000) << 16;
+    return f.f;
+}
+
+Codec::Codec(): mTable(1 << hashBits), mAllocations(0) {}
+
+size_t Codec::typeSize(const int& precision)
+{
+    switch (precision)
+    {
+        case Float: return sizeof(float);
+        case Half: return sizeof(unsigned short);
+        case Preview: return sizeof(unsigned char);
+    }
+    return 0;
+}
+
+size_t Codec::packedSize(const size_t& count,
+                         const int& spp,
+                         const int& precision)
+{
+    // Preview samples are preceded by the range of every channel
+    const size_t ranges = precision == Preview ? 2 * spp * sizeof(float) : 0;
+    return ranges + count * typeSize(precision);
+}
+
+void Codec::pack(const float* src,
+                 const size_t& count,
+                 const int& spp,
+                 const int& precision,
+                 std::vector<char>& out)
+{
+    out.resize(packedSize(count, spp, precision));
+
+    switch (precision)
+    {
+        case Float:
+        {
+            memcpy(&out[0], src, count * sizeof(float));
+            break;
+        }
+        case Half:
+        {
+            unsigned short* h = reinterpret_cast<unsigned short*>(&out[0]);
+            for (size_t i = 0; i < count; ++i)
+                h[i] = floatToHalf(src[i]);
+            break;
+        }
+        case Preview:
+        {
+            // Range of every channel within the bucket
+            float* minimum = reinterpret_cast<float*>(&out[0]);
+            float* scale = minimum + spp;
+            for (int c = 0; c < spp; ++c)
+            {
+                float lo = src[c], hi = src[c];
+                for (size_t i = c; i < count; i += spp)
+                {
+                    lo = std::min(lo, src[i]);
+                    hi = std::max(hi, src[i]);
+                }
+                minimum[c] = lo;
+                scale[c] = (hi - lo) / 255.0f;
+            }
+
+            unsigned char* q = reinterpret_cast<unsigned char*>(scale + spp);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const int c = static_cast<int>(i % spp);
+                const float v = scale[c] > 0 ? (src[i] - minimum[c]) / scale[c] + 0.5f : 0.0f;
+                q[i] = static_cast<unsigned char>(std::min(std::max(v, 0.0f), 255.0f));
+            }
+            break;
+        }
+    }
+}
+
+void Codec::subsample(const float* src,
+                      const int& width,
+                      const int& height,
+                      const int& spp,
+                      const int& step,
+                      float* dst)
+{
+    for (int y = 0; y < height; y += step)
+    {
+        const float* row = src + static_cast<size_t>(y) * width * spp;
+        for (int x = 0; x < width; x += step, dst += spp)
+            memcpy(dst, row + x * spp, sizeof(float) * spp);
+    }
+}
+
+void Codec::expand(const float* src,
+                   const int& width,
+                   const int& height,
+                   const int& spp,
+                   const int& step,
+                   float* dst)
+{
+    const int src_width = subsampledSize(width, step);
+    for (int y = 0; y < height; ++y)
+    {
+        const float* row = src + static_cast<size_t>(y / step) * src_width * spp;
+        for (int x = 0; x < width; ++x, dst += spp)
+            memcpy(dst, row + (x / step) * spp, sizeof(float) * spp);
+    }
+}
+
+unsigned long long Codec::hash(const void* data,
+                              const size_t& size,
+                              const unsigned long long& seed)
+{
+    const unsigned long long prime = 0x9E3779B97F4A7C15ULL;
+    const char* p = static_cast<const char*>(data);
+    const char* end = p + size;
+    
+    // Mix in 8 bytes at a time, then the tail
+    unsigned long long h = (seed ^ size) * prime;
+    unsigned long long word;
+    for (; end - p >= 8; p += 8)
+    {
+        memcpy(&word, p, 8);
+        h = (h ^ word) * prime;
+        h ^= h >> 29;
+    }
+    
+    word = 0;
+    memcpy(&word, p, end - p);
+    h = (h ^ word) * prime;
+    
+    // Final avalanche
+    h ^= h >> 32;
+    h *= prime;
+    h ^= h >> 29;
+    return h;
+}
+
+bool Codec::unpack(const char* src,
+                   const size_t& size,
+                   const int& spp,
+                   const int& precision,
+                   float* dst,
+                   const size_t& count)
+{
+    if (typeSize(precision) == 0 || spp <= 0 ||
+        size != packedSize(count, spp, precision))
+        return false;
+
+    switch (precision)
+    {
+        case Float:
+        {
+            memcpy(dst, src, size);
+            break;
+        }
+        case Half:
+        {
+            const unsigned short* h = reinterpret_cast<const unsigned short*>(src);
+            for (size_t i = 0; i < count; ++i)
+                dst[i] = halfToFloat(h[i]);
+            break;
+        }
+        case Preview:
+        {
+            const float* minimum = reinterpret_cast<const float*>(src);
+            const float* scale = minimum + spp;
+            const unsigned char* q = reinterpret_cast<const unsigned char*>(scale + spp);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const int c = static_cast<int>(i % spp);
+                dst[i] = minimum[c] + q[i] * scale[c];
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+int Codec::encode(const void* src,
+                  const size_t& size,
+                  const size_t& typeSize,
+                  const size_t& pixelSize,
+                  std::vector<char>& out)
+{
+    const char* in = static_cast<const char*>(src);
+    out.clear();
+
+    if (size == 0)
+        return Raw;
+
+    // Every pixel is the same as the first one
+    if (pixelSize > 0 && pixelSize < size && size % pixelSize == 0 &&
+        memcmp(in + pixelSize, in, size - pixelSize) == 0)
+    {
+        out.assign(in, in + pixelSize);
+        return Constant;
+    }
+
+    // Split the elements into byte planes
+    resizeBuffer(mPlanes, size, mAllocations);
+    const size_t count = size / typeSize;
+    for (size_t b = 0; b < typeSize; ++b)
+    {
+        char* plane = &mPlanes[b * count];
+        const char* element = in + b;
+        for (size_t i = 0; i < count; ++i, element += typeSize)
+            plane[i] = *element;
+    }
+
+    if (compress(&mPlanes[0], size, out))
+        return ShuffleLZ;
+
+    out.clear();
+    return Raw;
+}
+
+bool Codec::decode(const int& type,
+                   const char* src,
+                   const size_t& srcSize,
+                   void* dst,
+                   const size_t& dstSize,
+                   const size_t& typeSize)
+{
+    char* out = static_cast<char*>(dst);
+
+    switch (type)
+    {
+        case Raw:
+        {
+            if (srcSize != dstSize)
+                return false;
+            memcpy(out, src, dstSize);
+            return true;
+        }
+        case Constant:
+        {
+            if (srcSize == 0 || dstSize % srcSize != 0)
+                return false;
+
+            // Fill by doubling what has been written so far
+            memcpy(out, src, srcSize);
+            size_t filled = srcSize;
+            while (filled < dstSize)
+            {
+                const size_t n = std::min(filled, dstSize - filled);
+                memcpy(out + filled, out, n);
+                filled += n;
+            }
+            return true;
+        }
+        case ShuffleLZ:
+        {
+            if (typeSize == 0 || dstSize % typeSize != 0)
+                return false;
+
+            resizeBuffer(mPlanes, dstSize, mAllocations);
+            if (!decompress(src, srcSize, &mPlanes[0], dstSize))
+                return false;
+
+            // Put the byte planes back together
+            const size_t count = dstSize / typeSize;
+            for (size_t b = 0; b < typeSize; ++b)
+            {
+                const char* plane = &mPlanes[b * count];
+                char* element = out + b;
+                for (size_t i = 0; i < count; ++i, element += typeSize)
+                    *element = plane[i];
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Codec::compress(const char* src, const size_t& size, std::vector<char>& out)
+{
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+
+    // Output has to be smaller than the input to be worth it
+    out.resize(size);
+    unsigned char* begin = reinterpret_cast<unsigned char*>(&out[0]);
+    unsigned char* op = begin;
+    const unsigned char* end = begin + size;
+
+    // Table holds positions + 1, so 0 means empty
+    std::fill(mTable.begin(), mTable.end(), 0);
+
+    size_t ip = 0, anchor = 0, misses = 0;
+    while (size > minMatch && ip < size - minMatch)
+    {
+        unsigned int sequence;
+        memcpy(&sequence, in + ip, minMatch);
+        const unsigned int h = (sequence * 2654435761U) >> (32 - hashBits);
+        const size_t ref = mTable[h];
+        mTable[h] = static_cast<unsigned int>(ip + 1);
+
+        if (ref == 0 || ip - (ref - 1) > maxOffset ||
+            memcmp(in + ref - 1, in + ip, minMatch) != 0)
+        {
+            // Skip faster through data that doesn't compress
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        const size_t match = ref - 1;
+        size_t length = minMatch;
+        while (ip + length < size && in[match + length] == in[ip + length])
+            ++length;
+
+        if (!writeSequence(op, end, in + anchor, ip - anchor, ip - match, length))
+            return false;
+
+        ip += length;
+        anchor = ip;
+        misses = 0;
+    }
+
+    if (!writeSequence(op, end, in + anchor, size - anchor, 0, 0))
+        return false;
+
+    out.resize(op - begin);
+    return true;
+}
+
+bool Codec::decompress(const char* src, const size_t& srcSize, char* dst, const size_t& dstSize)
+{
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = ip + srcSize;
+    unsigned char* begin = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* op = begin;
+    const unsigned char* opEnd = begin + dstSize;
+
+    while (ip < end)
+    {
+        const unsigned char token = *ip++;
+
+        // Literals
+        size_t length = token >> 4;
+        if (length == 15 && !readLength(ip, end, length))
+            return false;
+        if (length > static_cast<size_t>(end - ip) ||
+            length > static_cast<size_t>(opEnd - op))
+            return false;
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+
+        // Last sequence has no match
+        if (ip == end)
+            break;
+
+        // Match
+        if (end - ip < 2)
+            return false;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - begin))
+            return false;
+
+        length = token & 15;
+        if (length == 15 && !readLength(ip, end, length))
+            return false;
+        length += minMatch;
+        if (length > static_cast<size_t>(opEnd - op))
+            return false;
+
+        const unsigned char* ref = op - offset;
+        if (offset >= length)
+            memcpy(op, ref, length);
+        else
+            for (size_t i = 0; i < length; ++i)
+                op[i] = ref[i];
+        op += length;
+    }
+
+    return op == opEnd;
+}
+
+void CodecStats::add(const long long& rawBytes,
+                     const long long& codedBytes,
+                     const double& us)
+{
+    mRawBytes += rawBytes;
+    mCodedBytes += codedBytes;
+    mTime += us;
+}
+
+void CodecStats::add(const CodecStats& other)
+{
+    mRawBytes += other.mRawBytes;
+    mCodedBytes += other.mCodedBytes;
+    mUnchangedBytes += other.mUnchangedBytes;
+    mTime += other.mTime;
+}
+
+void CodecStats::reset()
+{
+    mRawBytes = mCodedBytes = mUnchangedBytes = 0;
+    mTime = 0;
+}
+
+double CodecStats::ratio() const
+{
+    return mCodedBytes > 0 ? static_cast<double>(mRawBytes) / mCodedBytes : 1.0;
+}
+
+double CodecStats::rate() const
+{
+    return mTime > 0 ? (mRawBytes / 1048576.0) / (mTime / 1000000.0) : 0.0;
+}
@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_CODEC_H_
+#define ATON_CODEC_H_
+
+#include <vector>
+#include <cstddef>
+
+// Resizes a buffer that is reused from message to message, counting in
+// allocations the times it had to grow
+template <typename T>
+inline void resizeBuffer(std::vector<T>& buffer,
+                         const size_t& size,
+                         long long& allocations)
+{
+    if (size > buffer.capacity())
+        ++allocations;
+    buffer.resize(size);
+}
+
+// Lossless compression of bucket payloads
+// Payloads are arrays of fixed size elements (e.g. floats). They get
+// shuffled into byte planes, so that the slowly changing sign and
+// exponent bytes end up next to each other, and then go through a small
+// LZ stage. Buckets where every pixel holds the same value (e.g. empty
+// background) are reduced to a single pixel, and buckets the Server
+// already has are not sent at all.
+// Before that, pixels can be packed to a lower precision: IEEE half, or
+// 8-bit samples quantized between the per-channel range of the bucket.
+// A Codec keeps its scratch buffers between calls, so use one per thread.
+class Codec
+{
+public:
+    // How a payload was encoded
+    enum Type
+    {
+        Raw = 0,
+        Constant = 1,
+        ShuffleLZ = 2,
+        Unchanged = 3
+    };
+
+    // Precision the samples travel in
+    enum Precision
+    {
+        Float = 0,
+        Half = 1,
+        Preview = 2
+    };
+
+    Codec();
+
+    // Size of one packed sample in bytes, 0 for an unknown precision
+    static size_t typeSize(const int& precision);
+
+    // Size of count samples of spp channels packed to precision
+    static size_t packedSize(const size_t& count,
+                             const int& spp,
+                             const int& precision);
+
+    // Packs count float samples of spp channels to the given precision
+    void pack(const float* src,
+              const size_t& count,
+              const int& spp,
+              const int& precision,
+              std::vector<char>& out);
+
+    // Keeps one pixel out of every step in both directions of a width
+    // by height bucket of spp channels
+    static void subsample(const float* src,
+                          const int& width,
+                          const int& height,
+                          const int& spp,
+                          const int& step,
+                          float* dst);
+
+    // Fills a width by height bucket back from its subsampled pixels
+    static void expand(const float* src,
+                       const int& width,
+                       const int& height,
+                       const int& spp,
+                       const int& step,
+                       float* dst);
+
+    // Size of a bucket side once subsampled
+    static int subsampledSize(const int& size, const int& step) { return (size + step - 1) / step; }
+
+    // 64-bit hash of size bytes, used to spot buckets that didn't change
+    static unsigned long long hash(const void* data,
+                                   const size_t& size,
+                                   const unsigned long long& seed = 0);
+
+    // Expands packed samples back to count floats
+    // Returns false if the size doesn't match what was expected.
+    bool unpack(const char* src,
+                const size_t& size,
+                const int& spp,
+                const int& precision,
+                float* dst,
+                const size_t& count);
+
+    // Encodes size bytes of typeSize elements into out and returns the
+    // Type used. pixelSize is the size of one pixel in bytes, used to
+    // detect constant payloads. Falls back to Raw (leaving out empty)
+    // when compression doesn't make the payload smaller.
+    int encode(const void* src,
+               const size_t& size,
+               const size_t& typeSize,
+               const size_t& pixelSize,
+               std::vector<char>& out);
+
+    // Decodes an encoded payload into exactly dstSize bytes of dst
+    // Returns false if the payload is corrupt.
+    bool decode(const int& type,
+                const char* src,
+                const size_t& srcSize,
+                void* dst,
+                const size_t& dstSize,
+                const size_t& typeSize);
+    
+    // Times the scratch buffers had to grow
+    const long long& allocations() const { return mAllocations; }
+
+private:
+    // LZ stage, returns false if the output would not be smaller
+    bool compress(const char* src, const size_t& size, std::vector<char>& out);
+    bool decompress(const char* src, const size_t& srcSize, char* dst, const size_t& dstSize);
+
+    // Byte planes and match finder
+    std::vector<char> mPlanes;
+    std::vector<unsigned int> mTable;
+    long long mAllocations;
+};
+
+// Accumulates how much a codec saved and how fast it ran
+class CodecStats
+{
+public:
+    CodecStats() { reset(); }
+
+    void add(const long long& rawBytes,
+             const long long& codedBytes,
+             const double& us);
+
+    // Adds up the statistics of another codec
+    void add(const CodecStats& other);
+
+    // Counts pixels that were not sent because they didn't change
+    void addUnchanged(const long long& rawBytes) { mUnchangedBytes += rawBytes; }
+
+    void reset();
+
+    // Raw size divided by coded size
+    double ratio() const;
+
+    // Raw megabytes processed per second
+    double rate() const;
+
+    const long long& rawBytes() const { return mRawBytes; }
+    const long long& codedBytes() const { return mCodedBytes; }
+    const long long& unchangedBytes() const { return mUnchangedBytes; }
+
+private:
+    long long mRawBytes, mCodedBytes, mUnchangedBytes;
+    double mTime;
+};
+
+#endif // ATON_CODEC_H_
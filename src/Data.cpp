@@ -7,6 +7,18 @@ All rights reserved. See COPYING.txt for more details.
 #include "Data.h"
 #include <iostream>
 
+const char* qualityName(const int& quality)
+{
+    switch (quality)
+    {
+        case QUALITY_FULL: return "full";
+        case QUALITY_PRIMARY: return "primary AOV only";
+        case QUALITY_LOW: return "low precision";
+        case QUALITY_SUBSAMPLED: return "subsampled";
+    }
+    return "unknown";
+}
+
 Data::Data(const int& xres,
            const int& yres,
            const int& bucket_xo,
@@ -18,37 +30,124 @@ Data::Data(const int& xres,
            const float& currentFrame,
            const float& cam_fov,
            const float* cam_matrix,
-           const int& spp,
            const long long& ram,
-           const int& time,
-           const char* aovName, 
-           const float* data ): mType(-1),
-                                mXres(xres),
-                                mYres(yres),
-                                mBucket_xo(bucket_xo),
-                                mBucket_yo(bucket_yo),
-                                mBucket_size_x(bucket_size_x),
-                                mBucket_size_y(bucket_size_y),
-                                mRArea(rArea),
-                                mVersion(version),
-                                mCurrentFrame(currentFrame),
-                                mCamFov(cam_fov),
-                                mSpp(spp),
-                                mRam(ram),
-                                mTime(time),
-                                mAovName(aovName)
+           const int& time): mType(-1),
+                             mXres(xres),
+                             mYres(yres),
+                             mBucket_xo(bucket_xo),
+                             mBucket_yo(bucket_yo),
+                             mBucket_size_x(bucket_size_x),
+                             mBucket_size_y(bucket_size_y),
+                             mVersion(version),
+                             mCurrentFrame(currentFrame),
+                             mCamFov(cam_fov),
+                             mCamMatrix(NULL),
+                             mTime(time),
+                             mSequence(0),
+                             mSession(0),
+                             mImageId(0),
+                             mQuality(QUALITY_FULL),
+                             mSubsample(1),
+                             mRArea(rArea),
+                             mRam(ram)
 {
-    if (data != NULL)
-        mpData = const_cast<float*>(data);
-    
     if (cam_matrix != NULL)
         mCamMatrix = const_cast<float*>(cam_matrix);
 }
 
-void Data::dealloc()
+Data::Data(const Data& other)
+{
+    *this = other;
+}
+
+Data& Data::operator=(const Data& other)
+{
+    if (this == &other)
+        return *this;
+    
+    mType = other.mType;
+    mXres = other.mXres;
+    mYres = other.mYres;
+    mBucket_xo = other.mBucket_xo;
+    mBucket_yo = other.mBucket_yo;
+    mBucket_size_x = other.mBucket_size_x;
+    mBucket_size_y = other.mBucket_size_y;
+    mVersion = other.mVersion;
+    mCurrentFrame = other.mCurrentFrame;
+    mCamFov = other.mCamFov;
+    mCamMatrix = other.mCamMatrix;
+    mCamMatrixStore = other.mCamMatrixStore;
+    mTime = other.mTime;
+    mSequence = other.mSequence;
+    mSession = other.mSession;
+    mImageId = other.mImageId;
+    mQuality = other.mQuality;
+    mSubsample = other.mSubsample;
+    mTarget = other.mTarget;
+    mRArea = other.mRArea;
+    mRam = other.mRam;
+    mAovs = other.mAovs;
+    mPlanes = other.mPlanes;
+    mPixelStore = other.mPixelStore;
+    
+    // Planes owned by other now live in our store
+    if (!mPixelStore.empty())
+    {
+        const float* begin = &other.mPixelStore[0];
+        const float* end = begin + other.mPixelStore.size();
+        
+        std::vector<Plane>::iterator it;
+        for (it = mPlanes.begin(); it != mPlanes.end(); ++it)
+            if (it->data >= begin && it->data < end)
+                it->data = &mPixelStore[0] + (it->data - begin);
+    }
+    return *this;
+}
+
+void Data::clear()
+{
+    mType = -1;
+    mXres = mYres = 0;
+    mBucket_xo = mBucket_yo = 0;
+    mBucket_size_x = mBucket_size_y = 0;
+    mVersion = 0;
+    mCurrentFrame = 0.0f;
+    mCamFov = 0.0f;
+    mCamMatrix = NULL;
+    mTime = 0;
+    mSequence = 0;
+    mSession = 0;
+    mImageId = 0;
+    mQuality = QUALITY_FULL;
+    mSubsample = 1;
+    mTarget.clear();
+    mRArea = mRam = 0;
+    
+    // AOVs of the last image open stay, its buckets refer to them
+    mPlanes.clear();
+    mPixelStore.clear();
+}
+
+void Data::addAov(const char* name, const int& spp)
+{
+    Aov aov;
+    aov.name = name;
+    aov.spp = spp;
+    mAovs.push_back(aov);
+}
+
+void Data::addPlane(const int& aov,
+                    const int& spp,
+                    const float* data,
+                    const int& precision)
 {
-    delete[] mAovName;
-    mAovName = NULL;
+    Plane plane;
+    plane.aov = aov;
+    plane.spp = spp;
+    plane.precision = precision;
+    plane.name = NULL;
+    plane.data = data;
+    mPlanes.push_back(plane);
 }
 
 Data::~Data() { }
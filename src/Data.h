@@ -8,19 +8,148 @@ All rights reserved. See COPYING.txt for more details.
 #define ATON_DATA_H_
 
 #include <vector>
+#include <string>
+#include <cstddef>
+
+// Capabilities a Client asks for when it connects
+// The Server answers with the subset it supports and both sides use
+// only those for the rest of the connection. With CAP_VERSION the Server
+// follows its answer with the newest protocol version it speaks, and
+// the Client replies with the one they will use, no newer than either.
+// Clients that don't ask for it speak version 0. Drivers from before the
+// handshake open their image without one, and are still read the way
+// they write: one image per connection, one AOV per bucket message.
+// Version 0 messages are a key followed by their fields. From version 1
+// on the key is followed by the size in bytes of the rest of the
+// message, so that the Server can read past the messages it doesn't know
+// and the fields newer Clients add at their end. All fields are in the
+// byte order of the hosts, which is little-endian on every platform we
+// build for.
+enum Capability
+{
+    CAP_COMPRESSION = 1,
+    CAP_HALF = 2,
+    CAP_PREVIEW = 4,
+    CAP_SHM = 8,
+    CAP_UNCHANGED = 16,
+    CAP_SUBSAMPLE = 32,
+    CAP_STREAMS = 64,
+    CAP_REGION = 128,
+    CAP_TARGET = 256,
+    CAP_VERSION = 512,
+    CAP_BATCH = 1024,   // Small buckets go several to a message, version 1 on
+    CAP_STRIPS = 2048   // Big buckets go in row strips, version 1 on
+};
+
+// Newest protocol version, see CAP_VERSION
+const int protocolVersion = 1;
+
+// How much a bucket was degraded to keep up with a slow link
+// Each level includes the ones before it.
+enum Quality
+{
+    QUALITY_FULL = 0,
+    QUALITY_PRIMARY = 1,    // Only the primary (viewed) AOV is sent
+    QUALITY_LOW = 2,        // Colour planes go one precision lower
+    QUALITY_SUBSAMPLED = 3  // Every other pixel and row is sent
+};
+
+// Short description of a Quality level
+const char* qualityName(const int& quality);
+
+// Fixed layout of a bucket message header as it travels on the wire
+// Fields are packed in the order they are sent, so the whole header goes
+// out with a single write and is parsed with a single read on the Server
+// side. It is followed by planeCount planes, one per AOV. Subsampled
+// planes hold one pixel out of every subsample in both directions.
+// imageId is the generation of the image the bucket belongs to, as the
+// Client numbered it at image open.
+// Big buckets are sent as a message of type 5 instead, with CAP_STRIPS.
+// The header is followed by the number of rows of each strip, then by
+// the planes of the first strip, those of the second one and so on, so
+// that the Server can write the rows of a strip before the next arrives.
+// Strips of subsampled buckets start on a sampled row.
+#pragma pack(push, 1)
+struct BucketHeader
+{
+    int key,
+        imageId,
+        sequence,
+        xres,
+        yres,
+        bucket_xo,
+        bucket_yo,
+        bucket_size_x,
+        bucket_size_y;
+    long long rArea;
+    int version;
+    float currentFrame;
+    long long ram;
+    int time;
+    int quality;
+    int subsample;
+    int planeCount;
+};
+
+// Header of one AOV plane within a bucket message
+// The pixels that follow take payloadSize bytes, encoded with codec.
+struct PlaneHeader
+{
+    int aov;
+    int precision;
+    int codec;
+    int payloadSize;
+};
+#pragma pack(pop)
+
+// An AOV declared when the image is opened
+// Buckets refer to it by its index in the list of the image's AOVs.
+struct Aov
+{
+    std::string name;
+    int spp;
+};
+
+// The pixels of one AOV within a bucket
+struct Plane
+{
+    // Index of the AOV declared at image open
+    int aov;
+    
+    // Samples-per-pixel, aka channel depth
+    int spp;
+    
+    // Precision the pixels should travel in, see Codec::Precision
+    int precision;
+    
+    // Name of the AOV (server-side)
+    const char* name;
+    
+    // Pixel data, owned by the display driver (client-side)
+    // or by the Data object the plane belongs to (server-side).
+    // NULL when the Server already has these pixels from the previous
+    // iteration.
+    const float* data;
+};
 
 // Represents image information passed from Client to Server
 // This class wraps up the data sent from Client to Server. When calling
 // Client::openImage() a Data object should first be constructed that
-// specifies the full image dimensions.
-// E.g. Data( 0, 0, 320, 240, 3 );
+// specifies the full image dimensions, with every AOV of the image
+// declared through addAov().
+// E.g. Data( 320, 240 ); data.addAov( "RGBA", 4 );
+// A render of a region of the image gives the region as the bucket,
+// so that the Server can merge the regions rendered by several Clients.
+// E.g. Data( 320, 240, 160, 0, 160, 240, 160*240 );
 // When sending actually pixel information it should be constructed using
-// values that represent the chunk of pixels being sent.
-// E.g. Data( 15, 15, 16, 16, 3, myPixelPointer );
+// values that represent the chunk of pixels being sent, with one plane
+// added per AOV.
+// E.g. Data( 320, 240, 15, 15, 16, 16 ); data.addPlane( 0, 4, myPixelPointer );
 class Data
 {
 friend class Client;
-friend class Server;
+friend class Connection;
+friend class Sender;
 public:
     Data(const int& xres = 0,
          const int& yres = 0,
@@ -33,11 +162,13 @@ public:
          const float& currentFrame = 0.0f,
          const float& cam_fov = 0.0f,
          const float* cam_matrix = NULL,
-         const int& spp = 0,
          const long long& ram = 0,
-         const int& time = 0,
-         const char* aovName = NULL,
-         const float* data = NULL);
+         const int& time = 0);
+    
+    // Planes that point into the pixels owned by other are pointed
+    // at the copies
+    Data(const Data& other);
+    Data& operator=(const Data& other);
     
     ~Data();
     
@@ -45,6 +176,9 @@ public:
     // 0: image open
     // 1: pixels
     // 2: image close
+    // 3: connection handshake
+    // 4: batch of messages (never returned by the Server)
+    // 5: pixels in row strips (returned as 1)
     const int type() const { return mType; }
 
     // Get x resolution
@@ -80,40 +214,62 @@ public:
     // Camera matrix
     const std::vector<float>& camMatrix() const { return mCamMatrixStore; }
     
-    // Samples-per-pixel, aka channel depth
-    const int& spp() const { return mSpp; }
-    
     // Taken memory while rendering
     const long long& ram() const { return mRam; }
     
-    // Taken time while rendering
+    // Taken time while rendering, at image open the time of the last
+    // bucket the Server skipped before it, if any
     const unsigned int& time() const { return mTime; }
     
-    // Get Aov name
-    const char* aovName() const { return mAovName; }
+    // Sequence number of the message, the Client numbers the messages
+    // itself when it is 0
+    const int& sequence() const { return mSequence; }
+    
+    // Render and image the message belongs to, numbered by the Server
+    const long long& session() const { return mSession; }
+    const int& imageId() const { return mImageId; }
+    
+    // Name of the Aton node the render goes to (image open), any of
+    // them when empty
+    const std::string& target() const { return mTarget; }
+    void setTarget(const std::string& target) { mTarget = target; }
     
-    // Deallocate Aov name
-    void dealloc();
+    // Quality level the bucket was sent at
+    const int& quality() const { return mQuality; }
     
-    // Pointer to pixel data owned by the display driver (client-side)
-    const float* data() const { return mpData; }
+    // Pixel step of the planes (client-side), 1 for all of them
+    const int& subsample() const { return mSubsample; }
     
-    // Reference to pixel data owned by this object (server-side)
-    const float& pixel(int index = 0) { return mPixelStore[index]; }
+    // Declare an AOV of the image (image open)
+    void addAov(const char* name, const int& spp);
+    
+    // AOVs of the image (image open)
+    const std::vector<Aov>& aovs() const { return mAovs; }
+    
+    // Add the pixels of an AOV to the bucket (client-side)
+    void addPlane(const int& aov,
+                  const int& spp,
+                  const float* data,
+                  const int& precision = 0);
+    
+    // AOV planes of the bucket
+    const std::vector<Plane>& planes() const { return mPlanes; }
     
 private:
+    // Resets the message for the next one, keeping its buffers
+    void clear();
+    
     // What type of data is this?
     int mType;
 
     // Resolution, X & Y position,
-    // Bucket width height, Num of channels (samples)
+    // Bucket width height
     int mXres,
         mYres,
         mBucket_xo,
         mBucket_yo,
         mBucket_size_x,
-        mBucket_size_y,
-        mSpp;
+        mBucket_size_y;
 
     // Version number
     int mVersion;
@@ -130,15 +286,30 @@ private:
     // Width, height, num channels (samples)
     unsigned int mTime;
     
+    // Order of the message among the streams of a render
+    int mSequence;
+    
+    // Server ids of the render and of its image
+    long long mSession;
+    int mImageId;
+    
+    // Degradation of the bucket
+    int mQuality, mSubsample;
+    
+    // Node the render goes to
+    std::string mTarget;
+    
     // Region area, Memory
     long long mRArea, mRam;
 
-    const char *mAovName;
-
-    // Our pixel data pointer (for driver-owned pixels)
-    float *mpData;
+    // AOVs declared at image open
+    std::vector<Aov> mAovs;
+    
+    // AOV planes of a bucket
+    std::vector<Plane> mPlanes;
 
-    // Our persistent pixel storage (for Data-owned pixels)
+    // Our persistent pixel storage (for Data-owned pixels), recycled
+    // when a Connection fills the same Data again
     std::vector<float> mPixelStore;
 };
 
@@ -6,7 +6,7 @@ All rights reserved. See COPYING.txt for more details.
 
 #include <ai.h>
 #include "Data.h"
-#include "Client.h"
+#include "Sender.h"
 
 using boost::asio::ip::tcp;
 
@@ -39,16 +39,33 @@ int getPort()
     return aton_port;
 }
 
+// Transport precision profiles
+// auto: beauty in float, everything else in half
+static const char* precisionProfiles[] = {"auto", "float", "half", "preview", NULL};
+
+enum PrecisionProfile
+{
+    PROFILE_AUTO = 0,
+    PROFILE_FLOAT,
+    PROFILE_HALF,
+    PROFILE_PREVIEW
+};
+
 struct ShaderData
 {
-    Client* client;
+    Sender* sender;
     int xres, yres, min_x, min_y, max_x, max_y;
+    int precision;
 };
 
 node_parameters
 {
     AiParameterStr("host", getHost());
     AiParameterInt("port", getPort());
+    AiParameterBool("compression", false);
+    AiParameterEnum("precision", PROFILE_AUTO, precisionProfiles);
+    AiParameterInt("streams", 1);
+    AiParameterStr("target", "");
     
 #ifdef ARNOLD_5
     AiMetaDataSetStr(nentry, NULL, "maya.translator", "aton");
@@ -67,7 +84,7 @@ node_parameters
 node_initialize
 {
     ShaderData* data = (ShaderData*)AiMalloc(sizeof(ShaderData));
-    data->client = NULL;
+    data->sender = NULL;
 
 #ifdef ARNOLD_5
     AiDriverInitialize(node, true);
@@ -84,6 +101,31 @@ driver_supports_pixel_type { return true; }
 
 driver_extension { return NULL; }
 
+// Logs how the sender adapted to the link
+static void logEvents(Sender* sender)
+{
+    const std::vector<std::string> events = sender->events();
+    std::vector<std::string>::const_iterator it;
+    for (it = events.begin(); it != events.end(); ++it)
+        AiMsgWarning("[Aton] %s", it->c_str());
+}
+
+// Samples-per-pixel of an AOV of the given pixel type
+static int aovSamples(const int& pixel_type)
+{
+    switch (pixel_type)
+    {
+        case(AI_TYPE_INT):
+        case(AI_TYPE_UINT):
+        case(AI_TYPE_FLOAT):
+            return 1;
+        case(AI_TYPE_RGBA):
+            return 4;
+        default:
+            return 3;
+    }
+}
+
 driver_open
 {
     // Construct full version number
@@ -109,6 +151,18 @@ driver_open
     const char* host = AiNodeGetStr(node, "host");    
     const int port = AiNodeGetInt(node, "port");
     
+    // Get capabilities to ask the server for
+    const int capabilities = (AiNodeGetBool(node, "compression") ? CAP_COMPRESSION : 0) |
+                             CAP_HALF | CAP_PREVIEW | CAP_UNCHANGED | CAP_SUBSAMPLE |
+                             CAP_REGION | CAP_TARGET | CAP_VERSION | CAP_BATCH |
+                             CAP_STRIPS;
+    
+    // Get transport precision profile
+    data->precision = AiNodeGetInt(node, "precision");
+    
+    // Get number of parallel connections
+    const int streams = std::max(AiNodeGetInt(node, "streams"), 1);
+    
     // Get Camera Matrix
     AtNode* camera = (AtNode*)AiNodeGetPtr(options, "camera");
     
@@ -163,23 +217,58 @@ driver_open
     else if(data->min_y >= 0 && data->max_y >= yres)
         data->yres = yres + (max_y - yres + 1);
     
+    // Get the region in image coordinates, which start at the region
+    // when it goes past the left or top. Several machines may be
+    // rendering other regions of the same frame.
+    int region_x = 0, region_y = 0;
+    int region_width = data->xres, region_height = data->yres;
+    if (min_x != INT_MIN && max_x != INT_MIN)
+    {
+        region_x = std::max(data->min_x, 0);
+        region_width = data->max_x - data->min_x + 1;
+    }
+    if (min_y != INT_MIN && max_y != INT_MIN)
+    {
+        region_y = std::max(data->min_y, 0);
+        region_height = data->max_y - data->min_y + 1;
+    }
+    
     // Get area of region
-    const long long rArea = data->xres * data->yres;
+    const long long rArea = static_cast<long long>(region_width) * region_height;
     
     // Make image header & send to server
-    Data header(data->xres, data->yres, 0, 0, 0, 0,
+    Data header(data->xres, data->yres, region_x, region_y, region_width, region_height,
                 rArea, version, currentFrame, cam_fov, cam_matrix);
+    
+    // Aton node to show the render in, by name
+    const char* target = AiNodeGetStr(node, "target");
+    header.setTarget(target);
+    
+    // Declare the AOVs, buckets refer to them by index
+    int pixel_type;
+    const char* aov_name;
+    while (AiOutputIteratorGetNext(iterator, &aov_name, &pixel_type, NULL))
+        header.addAov(aov_name, aovSamples(pixel_type));
+    AiOutputIteratorReset(iterator);
 
     try // Now we can connect to the server and start rendering
     {
-        if (data->client == NULL)
+        // Keep the connection of the previous IPR iteration unless
+        // the driver has been pointed to another server
+        if (data->sender != NULL && (data->sender->host() != host ||
+                                     data->sender->port() != port ||
+                                     data->sender->capabilities() != capabilities ||
+                                     data->sender->streams() != streams))
         {
-            boost::system::error_code ec;
-            boost::asio::ip::address::from_string(host, ec);
-            if (!ec)
-                data->client = new Client(host, port);
+            delete data->sender;
+            data->sender = NULL;
         }
-        data->client->openImage(header);
+        
+        if (data->sender == NULL)
+            data->sender = new Sender(host, port, capabilities, 256, streams);
+
+        data->sender->resetStats();
+        data->sender->openImage(header);
     }
     catch(const std::exception &e)
     {
@@ -207,43 +296,63 @@ driver_write_bucket
 #endif
 
     int pixel_type;
-    int spp = 0;
     const void* bucket_data;
     const char* aov_name;
     
+    // Report if the sender thread lost the server
+    const std::string error = data->sender->error();
+    if (!error.empty())
+        AiMsgError("ATON | %s", error.c_str());
+    
+    // Report when the link can't keep up
+    logEvents(data->sender);
+    
     if (data->min_x < 0)
         bucket_xo = bucket_xo - data->min_x;
     if (data->min_y < 0)
         bucket_yo = bucket_yo - data->min_y;
     
+    const long long ram = AiMsgUtilGetUsedMemory();
+    const unsigned int time = AiMsgUtilGetElapsedTime();
+    
+    // Create our data object, one plane per AOV
+    Data packet(data->xres, data->yres, bucket_xo, bucket_yo,
+                bucket_size_x, bucket_size_y, 0, 0, 0, 0, 0, ram, time);
+    
+    // AOVs come in the order they were declared at driver_open
+    int aov = 0;
     while (AiOutputIteratorGetNext(iterator, &aov_name, &pixel_type, &bucket_data))
     {
         const float* ptr = reinterpret_cast<const float*>(bucket_data);
-        const long long ram = AiMsgUtilGetUsedMemory();
-        const unsigned int time = AiMsgUtilGetElapsedTime();
 
-        switch (pixel_type)
+        // Integer AOVs travel as raw bits, so they keep full precision
+        int precision = Codec::Float;
+        if (pixel_type != AI_TYPE_INT && pixel_type != AI_TYPE_UINT)
+            precision = Codec::Half;
+        
+        // Apply the profile
+        if (precision != Codec::Float)
         {
-            case(AI_TYPE_INT):
-            case(AI_TYPE_UINT):
-            case(AI_TYPE_FLOAT):
-                spp = 1;
-                break;
-            case(AI_TYPE_RGBA):
-                spp = 4;
-                break;
-            default:
-                spp = 3;
+            switch (data->precision)
+            {
+                case PROFILE_AUTO:
+                    if (strcmp(aov_name, "RGBA") == 0)
+                        precision = Codec::Float;
+                    break;
+                case PROFILE_FLOAT:
+                    precision = Codec::Float;
+                    break;
+                case PROFILE_PREVIEW:
+                    precision = Codec::Preview;
+                    break;
+            }
         }
         
-        // Create our data object
-        Data packet(data->xres, data->yres, bucket_xo, bucket_yo,
-                    bucket_size_x, bucket_size_y, 0, 0, 0, 0, 0,
-                    spp, ram, time, aov_name, ptr);
-
-        // Send it to the server
-        data->client->sendPixels(packet);
+        packet.addPlane(aov++, aovSamples(pixel_type), ptr, precision);
     }
+
+    // Queue the whole bucket for the server
+    data->sender->sendPixels(packet);
 }
 
 driver_close
@@ -256,13 +365,35 @@ driver_close
     ShaderData* data = (ShaderData*)AiDriverGetLocalData(node);
 #endif
     
-    try
-    {
-        data->client->closeImage();
-    }
-    catch (const std::exception& e)
+    // Flush the queue
+    data->sender->closeImage();
+    
+    const std::string error = data->sender->error();
+    if (!error.empty())
+        AiMsgError("ATON | Error occured when trying to send the image: %s", error.c_str());
+    
+    logEvents(data->sender);
+    AiMsgInfo("[Aton] link: %s, %.1f MB/s",
+              qualityName(data->sender->quality()),
+              data->sender->throughput());
+    
+    // How often the render threads would have waited on the network
+    AiMsgInfo("[Aton] send queue peak depth: %d/%d, stalls: %d (%.2f ms)",
+              static_cast<int>(data->sender->peakDepth()),
+              static_cast<int>(data->sender->capacity()),
+              data->sender->stalls(),
+              data->sender->stallTime());
+    
+    if (data->sender->negotiated())
     {
-        AiMsgError("ATON | Error occured when trying to close connection");
+        const CodecStats& stats = data->sender->codecStats();
+        AiMsgInfo("[Aton] pixels sent at %.2f:1, encode: %.1f MB/s",
+                  stats.ratio(), stats.rate());
+        
+        // Buckets IPR re-rendered to the same pixels
+        if (data->sender->negotiated() & CAP_UNCHANGED)
+            AiMsgInfo("[Aton] unchanged pixels elided: %.2f MB",
+                      stats.unchangedBytes() / 1048576.0);
     }
 }
 
@@ -277,7 +408,7 @@ node_finish
     ShaderData* data = (ShaderData*)AiDriverGetLocalData(node);
 #endif
     
-    delete data->client;
+    delete data->sender;
     AiFree(data);
 
 #ifndef ARNOLD_5
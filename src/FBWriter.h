@@ -8,245 +8,1360 @@ All rights reserved. See COPYING.txt for more details.
 #define FBWriter_h
 
 #include "Aton.h"
+#include "Queue.h"
+#include "Server.h"
+#include <map>
+#include <set>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
-// Our FrameBuffer writer thread
-static void FBWriter(unsigned index, unsigned nthreads, void* data)
+// How long the streams of a render wait for each other at an image open
+// or close before going on without the missing ones
+static const int streamTimeout = 10;
+
+// Most blit workers a node can run
+static const int maxIngestWorkers = 64;
+
+// Planes waiting for a blit worker, per worker and in all
+static const int blitQueueSize = 256;
+static const int blitJobCount = 256;
+
+struct FBSession;
+
+// Region of a frame a render contributes, and how far it got
+struct FBRegion
 {
-    bool killThread = false;
-    std::vector<std::string> active_aovs;
+    int x, y, width, height;
+    long long received, ram;
+    int time;
+};
 
-    Aton* node = reinterpret_cast<Aton*> (data);
+// Renders writing to the same frame, each one with its own region
+// A heavy frame can be split across several machines, each of them
+// rendering a region of it and sending it as its own render. They all
+// land in the FrameBuffer of the frame, and the progress goes over the
+// union of their regions. A render with another resolution or camera
+// starts the frame over.
+struct FBMerge
+{
+    FBMerge(): xres(0), yres(0), fov(0), area(0) {}
+    
+    // Adds the region of a render, or starts it over
+    void open(FBSession* session, const Data& d)
+    {
+        const std::vector<float>& matrix = d.camMatrix();
+        if (d.xres() != xres || d.yres() != yres || d.camFov() != fov || matrix != camera)
+        {
+            regions.clear();
+            xres = d.xres();
+            yres = d.yres();
+            fov = d.camFov();
+            camera = matrix;
+        }
+        
+        FBRegion region;
+        region.x = d.bucket_xo();
+        region.y = d.bucket_yo();
+        region.width = d.bucket_size_x();
+        region.height = d.bucket_size_y();
+        region.received = region.ram = 0;
+        region.time = 0;
+        regions[session] = region;
+        update();
+    }
+    
+    void close(FBSession* session)
+    {
+        if (regions.erase(session))
+            update();
+    }
+    
+    // Area of the union of the regions, which may overlap
+    void update()
+    {
+        std::vector<int> xs, ys;
+        std::map<FBSession*, FBRegion>::const_iterator it;
+        for (it = regions.begin(); it != regions.end(); ++it)
+        {
+            xs.push_back(it->second.x);
+            xs.push_back(it->second.x + it->second.width);
+            ys.push_back(it->second.y);
+            ys.push_back(it->second.y + it->second.height);
+        }
+        std::sort(xs.begin(), xs.end());
+        std::sort(ys.begin(), ys.end());
+        
+        // Add up the cells of the grid the region edges make
+        area = 0;
+        for (size_t i = 0; i + 1 < xs.size(); ++i)
+        {
+            for (size_t j = 0; j + 1 < ys.size(); ++j)
+            {
+                for (it = regions.begin(); it != regions.end(); ++it)
+                {
+                    const FBRegion& r = it->second;
+                    if (xs[i] >= r.x && xs[i + 1] <= r.x + r.width &&
+                        ys[j] >= r.y && ys[j + 1] <= r.y + r.height)
+                    {
+                        area += static_cast<long long>(xs[i + 1] - xs[i]) * (ys[j + 1] - ys[j]);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    // Percentage of the union received
+    long long progress() const
+    {
+        long long received = 0;
+        std::map<FBSession*, FBRegion>::const_iterator it;
+        for (it = regions.begin(); it != regions.end(); ++it)
+            received += std::min(it->second.received,
+                                 static_cast<long long>(it->second.width) * it->second.height);
+        return area > 0 ? received * 100 / area : 0;
+    }
+    
+    // Memory of all the renders, and time of the slowest one
+    long long ram() const
+    {
+        long long ram = 0;
+        std::map<FBSession*, FBRegion>::const_iterator it;
+        for (it = regions.begin(); it != regions.end(); ++it)
+            ram += it->second.ram;
+        return ram;
+    }
+    
+    int time() const
+    {
+        int time = 0;
+        std::map<FBSession*, FBRegion>::const_iterator it;
+        for (it = regions.begin(); it != regions.end(); ++it)
+            time = std::max(time, it->second.time);
+        return time;
+    }
+    
+    // Frame layout the regions belong to
+    int xres, yres;
+    float fov;
+    std::vector<float> camera;
+    
+    std::map<FBSession*, FBRegion> regions;
+    long long area;
+};
 
-    while (!killThread)
+// An Aton node renders are shown in
+struct FBNode
+{
+    FBNode(Aton* node): node(node) {}
+    
+    // Takes the region of a render out of a frame,
+    // called with the node mutex held
+    void close(FBSession* session, const double& frame)
     {
-        // Accept incoming connections!
-        node->m_server.accept();
+        std::map<double, FBMerge>::iterator it = merges.find(frame);
+        if (it == merges.end())
+            return;
+        
+        it->second.close(session);
+        if (it->second.regions.empty())
+            merges.erase(it);
+    }
+    
+    Aton* node;
+    
+    // Renders of each frame, guarded by the node mutex
+    std::map<double, FBMerge> merges;
+};
 
-        // Our incoming data object
-        Data d;
+// Where a render goes in one of the nodes it is shown in
+struct FBView
+{
+    FBView(FBNode* target): target(target), node(target->node), frame(0) {}
+    
+    FBNode* target;
+    Aton* node;
+    
+    // Frame of the FrameBuffer the image goes to
+    double frame;
+    
+    std::vector<std::string> active_aovs;
+};
 
-        // Frame index in FrameBuffers
-        int f_index = 0;
-        // For progress percentage
-        long long progress, regionArea = 0;
+// A render, sent through one or more streams (connections)
+// Buckets are written as soon as any stream receives them. Image open and
+// close messages come through all the streams and are a barrier: the
+// last stream to get there applies it, once, then they all go on.
+struct FBSession
+{
+    FBSession(): streams(1),
+                 readers(0),
+                 pending(0),
+                 applied(0),
+                 arrived(0),
+                 applying(false),
+                 image_id(0),
+                 active_time(0),
+                 delta_time(0),
+                 allocations(0),
+                 blits(0) {}
+    
+    // Waits for the other streams to reach the message numbered sequence,
+    // returns true if the caller is the one that should apply it, and
+    // then call applied()
+    bool arrive(const int& sequence)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        
+        // Stream that was late, the others went on without it
+        if (sequence <= applied)
+            return false;
         
-        // Time to reset per every IPR iteration
-        static int _active_time, delta_time = 0;
+        if (sequence > pending)
+        {
+            pending = sequence;
+            arrived = 0;
+        }
+        ++arrived;
+        barrier.notify_all();
         
-        // Loop over incoming data
-        while ((d.type() == 2 || d.type() == 9) == false)
+        const boost::system_time timeout = boost::get_system_time() +
+                                           boost::posix_time::seconds(streamTimeout);
+        while (applied < sequence)
         {
-            // Listen for some data
-            try
+            if (!applying && (arrived >= streams - static_cast<int>(gone.size()) ||
+                              boost::get_system_time() >= timeout))
             {
-                d = node->m_server.listen();
+                applying = true;
+                return true;
             }
-            catch( ... )
+            barrier.timed_wait(lock, timeout);
+        }
+        return false;
+    }
+    
+    void done(const int& sequence)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        applied = sequence;
+        applying = false;
+        barrier.notify_all();
+    }
+    
+    // Streams that connected, and left
+    void join(Connection* connection)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        streams = connection->streams();
+        connections.push_back(connection);
+        gone.erase(connection->stream());
+        ++readers;
+    }
+    
+    bool leave(Connection* connection)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        connections.erase(std::find(connections.begin(), connections.end(), connection));
+        gone.insert(connection->stream());
+        barrier.notify_all();
+        return --readers == 0;
+    }
+    
+    // Barrier
+    int streams, readers;
+    int pending, applied, arrived;
+    bool applying;
+    std::set<int> gone;
+    std::vector<Connection*> connections;
+    boost::mutex mutex;
+    boost::condition_variable barrier;
+    
+    // Image being received, and the nodes it is shown in
+    int image_id;
+    std::vector<FBView> views;
+    
+    // Time to reset per every IPR iteration
+    int active_time, delta_time;
+    
+    // Receive buffer allocations of the streams when the last image closed
+    long long allocations;
+    
+    // Planes waiting for or being written by the blit workers
+    volatile int blits;
+};
+
+// Nodes listening on the same port, and which of them a render goes to
+// Renders name the node they go to. The ones that don't, or that name a
+// node that isn't there, go to the first node that was added, the only
+// one on the port unless several nodes share it. Nodes that follow
+// another one show its renders too, received once and written to all of
+// them. Threads touching a node hold the mutex shared, so that a node
+// can't go away under them.
+struct FBNodes
+{
+    ~FBNodes()
+    {
+        for (size_t i = 0; i < nodes.size(); ++i)
+            delete nodes[i];
+    }
+    
+    // Nodes a render sent to target goes to, the first one being the
+    // node it names. Called with the mutex held.
+    void route(const std::string& target, std::vector<FBNode*>& result) const
+    {
+        result.clear();
+        if (nodes.empty())
+            return;
+        
+        FBNode* primary = nodes[0];
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            if (!target.empty() && nodes[i]->node->m_node_name == target)
             {
+                primary = nodes[i];
                 break;
             }
+        }
+        
+        result.push_back(primary);
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            const std::string& follow = nodes[i]->node->m_follow;
+            if (nodes[i] != primary && !follow.empty() && primary->node->m_node_name == follow)
+                result.push_back(nodes[i]);
+        }
+    }
+    
+    // Most blit workers any node asks for, called with the mutex held
+    int workers() const
+    {
+        int count = 0;
+        for (size_t i = 0; i < nodes.size(); ++i)
+            count = std::max(count, nodes[i]->node->m_ingest_workers);
+        return std::min(count, maxIngestWorkers);
+    }
+    
+    std::vector<FBNode*> nodes;
+    boost::shared_mutex mutex;
+};
 
-            // Handle the data we received
-            switch (d.type())
+// Renders being received, by session id
+struct FBSessions
+{
+    // Finds the render the connection belongs to
+    FBSession* join(Connection* connection)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        FBSession*& session = sessions[connection->session()];
+        if (session == NULL)
+            session = new FBSession;
+        session->join(connection);
+        return session;
+    }
+    
+    void leave(FBNodes& nodes, FBSession* session, Connection* connection)
+    {
+        {
+            // Nodes can't go while the last stream takes the regions of
+            // the render out of them
+            boost::shared_lock<boost::shared_mutex> nodesLock(nodes.mutex);
             {
-                case 0: // Open a new image
+                boost::lock_guard<boost::mutex> lock(mutex);
+                if (!session->leave(connection))
+                    return;
+                
+                std::map<long long, FBSession*>::iterator it;
+                for (it = sessions.begin(); it != sessions.end(); ++it)
                 {
-                    // Copy data from d
-                    const int& _xres = d.xres();
-                    const int& _yres = d.yres();
-                    const int& _version = d.version();
-                    const float& _fov = d.camFov();
-                    const long long& _area = d.rArea();
-                    const Matrix4& _matrix = Matrix4(&d.camMatrix()[0]);
-                    const double& _frame = static_cast<double>(d.currentFrame());
-                    
-                    // Get image area to calculate the progress
-                    regionArea = _area;
-                    
-                    // Get delta time per IPR iteration
-                    delta_time = _active_time;
-                    
-                    // Set current frame
-                    node->m_current_frame = _frame;
-                    
-                    std::vector<double>& m_frs = node->m_frames;
-                    std::vector<FrameBuffer>& m_fbs = node->m_framebuffers;
-
-                    // Create FrameBuffer
-                    if (node->m_multiframes)
+                    if (it->second == session)
                     {
-                        if (std::find(m_frs.begin(), m_frs.end(), _frame) == m_frs.end())
-                        {
-                            FrameBuffer fB(_frame, _xres, _yres);
-                            if (!m_frs.empty())
-                                fB = m_fbs.back();
-                            WriteGuard lock(node->m_mutex);
-                            m_frs.push_back(_frame);
-                            m_fbs.push_back(fB);
-                        }
-                    }
-                    else
-                    {
-                        FrameBuffer fB(_frame, _xres, _yres);
-                        if (!node->m_frames.empty())
-                        {
-                            f_index = node->getFrameIndex(node->m_frames, node->m_current_frame);
-                            fB = m_fbs[f_index];
-                        }
-                        WriteGuard lock(node->m_mutex);
-                        m_frs = std::vector<double>();
-                        m_fbs = std::vector<FrameBuffer>();
-                        m_frs.push_back(_frame);
-                        m_fbs.push_back(fB);
-                    }
-                    
-                    // Get current FrameBuffer
-                    f_index = node->getFrameIndex(node->m_frames, _frame);
-                    FrameBuffer& fB = m_fbs[f_index];
-                    
-                    // Reset Frame and Buffers if changed
-                    if (!fB.empty() && !active_aovs.empty())
-                    {
-                        if (fB.isFrameChanged(_frame))
-                        {
-                            WriteGuard lock(node->m_mutex);
-                            fB.setFrame(_frame);
-                        }
-                        if(fB.isAovsChanged(active_aovs))
-                        {
-                            WriteGuard lock(node->m_mutex);
-                            fB.resize(1);
-                            fB.ready(false);
-                            node->resetChannels(node->m_channels);
-                        }
-                    }
-                    
-                    // Setting Camera
-                    if (fB.isCameraChanged(_fov, _matrix))
-                    {
-                        WriteGuard lock(node->m_mutex);
-                        fB.setCamera(_fov, _matrix);
-                        node->setCameraKnobs(fB.getCameraFov(),
-                                             fB.getCameraMatrix());
+                        sessions.erase(it);
+                        break;
                     }
+                }
+            }
+            
+            // Its regions are not coming anymore
+            std::vector<FBView>::iterator it;
+            for (it = session->views.begin(); it != session->views.end(); ++it)
+            {
+                WriteGuard guard(it->node->m_mutex);
+                it->target->close(session, it->frame);
+            }
+        }
+        delete session;
+    }
+    
+    size_t size()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return sessions.size();
+    }
+    
+    std::map<long long, FBSession*> sessions;
+    boost::mutex mutex;
+};
+
+// FrameBuffer of the given frame, or NULL if it was removed,
+// called with the node mutex held
+static FrameBuffer* FBFind(Aton* node, const double& frame)
+{
+    std::vector<double>& m_frs = node->m_frames;
+    if (m_frs.empty())
+        return NULL;
+    
+    // Only one FrameBuffer, shared by all the frames
+    if (!node->m_multiframes)
+        return &node->m_framebuffers[0];
+    
+    std::vector<double>::iterator it = std::find(m_frs.begin(), m_frs.end(), frame);
+    if (it == m_frs.end())
+        return NULL;
+    return &node->m_framebuffers[it - m_frs.begin()];
+}
+
+// Sets up the FrameBuffer of a node for a new image
+static void FBOpen(FBSession& session, FBView& view, Data& d)
+{
+    Aton* node = view.node;
+    
+    // Copy data from d
+    const int& _xres = d.xres();
+    const int& _yres = d.yres();
+    const int& _version = d.version();
+    const float& _fov = d.camFov();
+    const Matrix4& _matrix = Matrix4(&d.camMatrix()[0]);
+    const double& _frame = static_cast<double>(d.currentFrame());
+    
+    // Other renders may be opening their frames at the same time
+    WriteGuard lock(node->m_mutex);
+    
+    // Move the region of the render to the frame it is rendering now
+    if (view.frame != _frame)
+        view.target->close(&session, view.frame);
+    view.target->merges[_frame].open(&session, d);
+    
+    // Remember where the buckets of this image go
+    view.frame = _frame;
+    
+    // Set current frame
+    node->m_current_frame = _frame;
+    
+    std::vector<double>& m_frs = node->m_frames;
+    std::vector<FrameBuffer>& m_fbs = node->m_framebuffers;
+
+    // Create FrameBuffer
+    if (node->m_multiframes)
+    {
+        if (std::find(m_frs.begin(), m_frs.end(), _frame) == m_frs.end())
+        {
+            FrameBuffer fB(_frame, _xres, _yres);
+            if (!m_frs.empty())
+                fB = m_fbs.back();
+            m_frs.push_back(_frame);
+            m_fbs.push_back(fB);
+        }
+    }
+    else
+    {
+        FrameBuffer fB(_frame, _xres, _yres);
+        if (!m_frs.empty())
+            fB = m_fbs[0];
+        m_frs = std::vector<double>();
+        m_fbs = std::vector<FrameBuffer>();
+        m_frs.push_back(_frame);
+        m_fbs.push_back(fB);
+    }
+    
+    // Get current FrameBuffer
+    FrameBuffer& fB = *FBFind(node, _frame);
+    
+    // Reset Frame and Buffers if changed
+    if (!fB.empty() && !view.active_aovs.empty())
+    {
+        if (fB.isFrameChanged(_frame))
+            fB.setFrame(_frame);
+        
+        if(fB.isAovsChanged(view.active_aovs))
+        {
+            fB.resize(1);
+            fB.ready(false);
+            node->resetChannels(node->m_channels);
+        }
+    }
+    
+    // Setting Camera
+    if (fB.isCameraChanged(_fov, _matrix))
+    {
+        fB.setCamera(_fov, _matrix);
+        node->setCameraKnobs(fB.getCameraFov(),
+                             fB.getCameraMatrix());
+    }
+
+    // Set Arnold Core version
+    if (fB.getAiVersionInt() != _version)
+        fB.setAiVersion(_version);
+    
+    // Reset active AOVs
+    if(!view.active_aovs.empty())
+        view.active_aovs.clear();
+}
+
+// Sets up the nodes a new image goes to, called with the nodes mutex held
+static void FBOpenImage(FBNodes& nodes, FBSession& session, Data& d)
+{
+    // Get delta time per IPR iteration, the last buckets of the previous
+    // one may have been skipped
+    session.delta_time = std::max(session.active_time, static_cast<int>(d.time()));
+    session.image_id = d.imageId();
+    
+    // Nodes may have come, gone or started following others since the
+    // last image, the ones that still show the render keep their views
+    std::vector<FBNode*> targets;
+    nodes.route(d.target(), targets);
+    
+    std::vector<FBView> views;
+    for (size_t i = 0; i < targets.size(); ++i)
+    {
+        std::vector<FBView>::iterator it;
+        for (it = session.views.begin(); it != session.views.end(); ++it)
+            if (it->target == targets[i])
+                break;
+        views.push_back(it != session.views.end() ? *it : FBView(targets[i]));
+    }
+    
+    // Nodes that don't show it anymore lose its region
+    std::vector<FBView>::iterator it;
+    for (it = session.views.begin(); it != session.views.end(); ++it)
+    {
+        if (std::find(targets.begin(), targets.end(), it->target) == targets.end())
+        {
+            WriteGuard lock(it->node->m_mutex);
+            it->target->close(&session, it->frame);
+        }
+    }
+    
+    session.views.swap(views);
+    for (it = session.views.begin(); it != session.views.end(); ++it)
+        FBOpen(session, *it, d);
+}
+
+// Gets the FrameBuffer of a node ready for a plane of a bucket, with
+// the tiles under the bucket allocated, returns it or NULL if the plane
+// is not written.
+// Called with the node mutex held for writing.
+static FrameBuffer* FBPreparePlane(FBView& view,
+                                   const Data& d,
+                                   const Plane& plane)
+{
+    Aton* node = view.node;
+    const char* _aov_name = plane.name;
+    
+    FrameBuffer* fB = FBFind(node, view.frame);
+    if (fB == NULL)
+        return NULL;
+    
+    if(fB->isResolutionChanged(d.xres(), d.yres()))
+        fB->setResolution(d.xres(), d.yres());
+    
+    // Tiles take the size of the first bucket
+    fB->setTileSize(std::max(d.bucket_size_x(), d.bucket_size_y()));
+
+    // Get active aov names
+    if(std::find(view.active_aovs.begin(),
+                 view.active_aovs.end(),
+                 _aov_name) == view.active_aovs.end())
+    {
+        if (node->m_enable_aovs || view.active_aovs.empty())
+            view.active_aovs.push_back(_aov_name);
+        else if (view.active_aovs.size() > 1)
+            view.active_aovs.resize(1);
+    }
+    
+    // Skip non RGBA buckets if AOVs are disabled
+    if (!node->m_enable_aovs && view.active_aovs[0] != _aov_name)
+        return NULL;
+    
+    // Adding buffer
+    if(!fB->isBufferExist(_aov_name) && (node->m_enable_aovs || fB->empty()))
+        fB->addBuffer(_aov_name, plane.spp);
+    else
+        fB->ready(true);
+    
+    // Only the tiles the bucket covers, rows go bottom up
+    fB->allocate(fB->getBufferIndex(_aov_name), d.bucket_xo(),
+                 fB->getHeight() - d.bucket_yo() - d.bucket_size_y(),
+                 d.bucket_size_x(), d.bucket_size_y());
+    return fB;
+}
+
+// Copies the pixels of a plane of a bucket into buffer b,
+// called with the node mutex held
+static void FBBlitPlane(FrameBuffer& fB,
+                        const int& b,
+                        const int& _x,
+                        const int& _y,
+                        const int& _width,
+                        const int& _height,
+                        const int& _spp,
+                        const float* pixels)
+{
+    // Resolution may have changed since the bucket was sent
+    const int w = fB.getWidth();
+    const int h = fB.getHeight();
+    if (b < 0 || b >= static_cast<int>(fB.size()) ||
+        _x < 0 || _y < 0 || _x + _width > w || _y + _height > h)
+        return;
+    
+    // Whole bucket at once, the buffer flips it
+    fB.setBufferBucket(b, _x, _y, _spp, pixels, _width, _height);
+}
+
+// Writes one plane of a bucket to the FrameBuffer of a node,
+// pixels being NULL if the plane didn't change. Returns the height of
+// the FrameBuffer if pixels were written, 0 otherwise.
+static int FBWritePlane(FBView& view,
+                        const Data& d,
+                        const Plane& plane,
+                        const float* pixels)
+{
+    // Streams and other renders write concurrently, and may move the
+    // FrameBuffers around when they open a new frame
+    WriteGuard lock(view.node->m_mutex);
+    FrameBuffer* fB = FBPreparePlane(view, d, plane);
+    
+    // Unchanged pixels are already there
+    if (fB == NULL || pixels == NULL)
+        return 0;
+    
+    FBBlitPlane(*fB, fB->getBufferIndex(plane.name), d.bucket_xo(), d.bucket_yo(),
+                d.bucket_size_x(), d.bucket_size_y(), plane.spp, pixels);
+    return fB->getHeight();
+}
+
+// Backs off while a blit queue is empty or full, idle being the number
+// of consecutive tries that got nowhere
+static void FBBackoff(const int& idle)
+{
+    if (idle < 64)
+        boost::this_thread::yield();
+    else
+        boost::this_thread::sleep(boost::posix_time::microseconds(idle < 1024 ? 50 : 1000));
+}
+
+// Waits until the blit workers wrote all the planes of a session
+static void FBDrain(FBSession& session)
+{
+    for (int idle = 1; session.blits > 0; ++idle)
+        FBBackoff(idle);
+}
+
+// A plane of a bucket on its way to a blit worker
+struct FBBlit
+{
+    FBSession* session;
+    Aton* node;
+    double frame;
+    int buffer;
+    int x, y, width, height, spp;
+    std::vector<float> pixels;
+};
+
+// A blit worker and the planes waiting for it
+struct FBBlitWorker
+{
+    FBBlitWorker(): queue(blitQueueSize),
+                    thread(NULL),
+                    sleeping(0),
+                    running(0),
+                    stop(false) {}
+    
+    Queue<FBBlit*> queue;
+    boost::thread* thread;
+    
+    // Guards waking the worker up, starting and stopping it
+    boost::mutex mutex;
+    boost::condition_variable wake;
+    volatile int sleeping;
+    volatile int running;
+    bool stop;
+};
 
-                    // Set Arnold Core version
-                    if (fB.getAiVersionInt() != _version)
-                        fB.setAiVersion(_version);
-                    
-                    // Reset active AOVs
-                    if(!active_aovs.empty())
-                        active_aovs.clear();
-                    break;
+// Blit workers shared by all the streams
+// The streams receive and decode the buckets, get the FrameBuffer
+// ready for them in order, and leave copying the pixels to the workers.
+// Planes are routed by bucket position and AOV, so the same plane of
+// the same bucket always goes through the same worker, in order, while
+// different ones are written in parallel. Workers only hold the node
+// mutex for reading, FrameBuffers can't change under them but Nuke can
+// still read the pixels. Queues are lock-free, workers wait for the
+// streams to wake them up once theirs is empty, and are started when
+// the first plane comes their way.
+struct FBBlitPool
+{
+    FBBlitPool(): free(blitJobCount),
+                  jobs(0),
+                  quit(0)
+    {
+        // All of them up front, streams pick theirs without a mutex
+        for (int i = 0; i < maxIngestWorkers; ++i)
+            workers.push_back(new FBBlitWorker);
+    }
+    
+    ~FBBlitPool()
+    {
+        atomicAdd(&quit, 1);
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            FBBlitWorker* worker = workers[i];
+            {
+                boost::lock_guard<boost::mutex> lock(worker->mutex);
+                worker->wake.notify_one();
+            }
+            if (worker->thread != NULL)
+            {
+                worker->thread->join();
+                delete worker->thread;
+            }
+            delete worker;
+        }
+        
+        FBBlit* job;
+        while (free.pop(job))
+            delete job;
+    }
+    
+    // Takes a recycled job, or makes a new one until there are enough
+    FBBlit* acquire()
+    {
+        FBBlit* job;
+        for (int idle = 1; !free.pop(job); ++idle)
+        {
+            if (atomicAdd(&jobs, 0) < blitJobCount && atomicAdd(&jobs, 1) <= blitJobCount)
+                return new FBBlit;
+            FBBackoff(idle);
+        }
+        return job;
+    }
+    
+    // Gives back a job that didn't go to a worker
+    void release(FBBlit* job)
+    {
+        free.push(job);
+    }
+    
+    // Hands a job to the worker of its plane, count being how many
+    // workers the planes are routed over
+    void push(FBBlit* job, const int& count)
+    {
+        unsigned int hash = static_cast<unsigned int>(job->x) * 73856093u ^
+                            static_cast<unsigned int>(job->y) * 19349663u ^
+                            static_cast<unsigned int>(job->buffer) * 83492791u;
+        
+        // Buckets sit on multiples of their size, mix the high bits down
+        // or they all land on a few workers
+        hash ^= hash >> 16;
+        hash *= 0x45d9f3bu;
+        hash ^= hash >> 16;
+        FBBlitWorker* worker = workers[hash % count];
+        
+        // Only a running worker leaves its queue full
+        atomicAdd(&job->session->blits, 1);
+        for (int idle = 1; !worker->queue.push(job); ++idle)
+            FBBackoff(idle);
+        
+        // Wake it up, or start it if it isn't running
+        if (atomicAdd(&worker->sleeping, 0) || !atomicAdd(&worker->running, 0))
+        {
+            boost::lock_guard<boost::mutex> lock(worker->mutex);
+            if (worker->running)
+                worker->wake.notify_one();
+            else
+            {
+                // The last thread is on its way out already
+                if (worker->thread != NULL)
+                {
+                    worker->thread->join();
+                    delete worker->thread;
+                }
+                worker->running = 1;
+                worker->thread = new boost::thread(boost::bind(&FBBlitPool::run, this, worker));
+            }
+        }
+    }
+    
+    // Stops the workers past count once their queues are empty, streams
+    // still routing planes over more of them start them again
+    void resize(const int& count)
+    {
+        for (int i = 0; i < maxIngestWorkers; ++i)
+        {
+            FBBlitWorker* worker = workers[i];
+            boost::lock_guard<boost::mutex> lock(worker->mutex);
+            worker->stop = i >= count;
+            if (worker->stop)
+                worker->wake.notify_one();
+        }
+    }
+    
+    // Worker loop
+    void run(FBBlitWorker* worker)
+    {
+        while (true)
+        {
+            FBBlit* job;
+            if (!worker->queue.pop(job))
+            {
+                // Streams check whether we sleep after they push, so
+                // look at the queue again once they can tell
+                boost::unique_lock<boost::mutex> lock(worker->mutex);
+                atomicAdd(&worker->sleeping, 1);
+                const bool found = worker->queue.pop(job);
+                
+                // Streams are all gone once we are asked to quit
+                if (!found && (worker->stop || atomicAdd(&quit, 0)))
+                {
+                    worker->running = 0;
+                    atomicAdd(&worker->sleeping, -1);
+                    return;
                 }
-                case 1: // Write image data
+                
+                if (!found)
+                    worker->wake.wait(lock);
+                atomicAdd(&worker->sleeping, -1);
+                if (!found)
+                    continue;
+            }
+            
+            // Nodes wait for the jobs of all the sessions before they go
+            Aton* node = job->node;
+            int h = 0;
+            {
+                ReadGuard lock(node->m_mutex);
+                FrameBuffer* fB = FBFind(node, job->frame);
+                if (fB != NULL)
                 {
-                    // Get frame buffer
-                    FrameBuffer& fB = node->m_framebuffers[f_index];
-                    const char* _aov_name = d.aovName();
-                    const int& _xres = d.xres();
-                    const int& _yres = d.yres();
+                    FBBlitPlane(*fB, job->buffer, job->x, job->y,
+                                job->width, job->height, job->spp, &job->pixels[0]);
+                    h = fB->getHeight();
+                }
+            }
+            
+            // Show the pixels now that they are there
+            if (h > 0 && !node->m_capturing)
+                node->flagForUpdate(Box(job->x, h - job->y - job->height,
+                                        job->x + job->width, h - job->y));
+            
+            atomicAdd(&job->session->blits, -1);
+            free.push(job);
+        }
+    }
+    
+    Queue<FBBlit*> free;
+    volatile int jobs;
+    volatile int quit;
+    std::vector<FBBlitWorker*> workers;
+};
 
-                    if(fB.isResolutionChanged(_xres, _yres))
-                    {
-                        WriteGuard lock(node->m_mutex);
-                        fB.setResolution(_xres, _yres);
-                    }
+// Writes the planes of the buckets of a session to all the nodes it is
+// shown in as its Connection receives them, without copying them into
+// the Data first, or hands them to the blit workers. Planes for the
+// workers are received straight into a job, only nodes showing the same
+// session twice get copies of it.
+struct FBSink : public BucketSink
+{
+    FBSink(FBNodes* nodes, FBSession* session, FBBlitPool* pool): nodes(nodes),
+                                                                   session(session),
+                                                                   pool(pool),
+                                                                   pending(NULL),
+                                                                   workers(0) {}
+    
+    ~FBSink()
+    {
+        if (pending != NULL)
+            pool->release(pending);
+    }
+    
+    float* buffer(const Data&, const Plane&, const size_t& size)
+    {
+        // Last one never made it to write()
+        if (pending != NULL)
+            pool->release(pending);
+        pending = NULL;
+        
+        if (workers == 0)
+            return NULL;
+        
+        pending = pool->acquire();
+        pending->pixels.resize(size);
+        return &pending->pixels[0];
+    }
+    
+    void write(const Data& d, const Plane& plane, const float* pixels)
+    {
+        // The job the pixels were received into, if any
+        FBBlit* own = NULL;
+        if (pending != NULL && pixels == &pending->pixels[0])
+            own = pending;
+        else if (pending != NULL)
+            pool->release(pending);
+        pending = NULL;
+        
+        boost::shared_lock<boost::shared_mutex> lock(nodes->mutex);
+        
+        // Planes of a bucket would go another way than before, so let
+        // the ones on their way land first
+        const int count = nodes->workers();
+        if (count != workers)
+        {
+            FBDrain(*session);
+            workers = count;
+            pool->resize(workers);
+        }
+        
+        targets.clear();
+        std::vector<FBView>::iterator it;
+        for (it = session->views.begin(); it != session->views.end(); ++it)
+        {
+            if (workers == 0)
+            {
+                // Strips of big buckets show up as they land
+                const int h = FBWritePlane(*it, d, plane, pixels);
+                if (h > 0 && !it->node->m_capturing)
+                    it->node->flagForUpdate(Box(d.bucket_xo(), h - d.bucket_yo() - d.bucket_size_y(),
+                                                d.bucket_xo() + d.bucket_size_x(), h - d.bucket_yo()));
+                continue;
+            }
+            
+            // The plane name is the stream's, it goes with the next image
+            WriteGuard guard(it->node->m_mutex);
+            FrameBuffer* fB = FBPreparePlane(*it, d, plane);
+            if (fB != NULL && pixels != NULL)
+                targets.push_back(std::make_pair(&*it, fB->getBufferIndex(plane.name)));
+        }
+        
+        // The job the pixels are in goes last, the copies are made from it
+        const size_t size = d.bucket_size_x() * d.bucket_size_y() * plane.spp;
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            FBBlit* job = own;
+            if (job == NULL || i + 1 < targets.size())
+            {
+                job = pool->acquire();
+                job->pixels.assign(pixels, pixels + size);
+            }
+            else
+                own = NULL;
+            
+            const FBView& view = *targets[i].first;
+            job->session = session;
+            job->node = view.node;
+            job->frame = view.frame;
+            job->buffer = targets[i].second;
+            job->x = d.bucket_xo();
+            job->y = d.bucket_yo();
+            job->width = d.bucket_size_x();
+            job->height = d.bucket_size_y();
+            job->spp = plane.spp;
+            pool->push(job, workers);
+        }
+        
+        if (own != NULL)
+            pool->release(own);
+    }
+    
+    FBNodes* nodes;
+    FBSession* session;
+    FBBlitPool* pool;
+    
+    // Job handed out by buffer() for the next plane
+    FBBlit* pending;
+    
+    // Views and buffers the plane being written goes to
+    std::vector<std::pair<FBView*, int> > targets;
+    
+    // Workers the planes were last routed over
+    int workers;
+};
 
-                    // Get active aov names
-                    if(std::find(active_aovs.begin(),
-                                 active_aovs.end(),
-                                 _aov_name) == active_aovs.end())
-                    {
-                        if (node->m_enable_aovs || active_aovs.empty())
-                            active_aovs.push_back(_aov_name);
-                        else if (active_aovs.size() > 1)
-                            active_aovs.resize(1);
-                    }
-                    
-                    // Skip non RGBA buckets if AOVs are disabled
-                    if (node->m_enable_aovs || active_aovs[0] == _aov_name)
+// Finishes a bucket in a node, writing the planes that didn't go through
+// an FBSink, and updates the status. The timeline follows the frame being
+// rendered, unless renders of several frames are coming in at once.
+static void FBWrite(FBSession& session, FBView& view, Data& d)
+{
+    Aton* node = view.node;
+    
+    const std::vector<Plane>& planes = d.planes();
+    for (size_t p = 0; p < planes.size(); ++p)
+        if (planes[p].data != NULL)
+            FBWritePlane(view, d, planes[p], planes[p].data);
+    
+    // Get data from d
+    const int& _x = d.bucket_xo();
+    const int& _y = d.bucket_yo();
+    const int& _width = d.bucket_size_x();
+    const int& _height = d.bucket_size_y();
+    const long long& _ram = d.ram();
+    const int& _time = d.time();
+    
+    // Set active time
+    session.active_time = _time;
+    
+    if (node->m_capturing)
+        return;
+    
+    // Set status parameters
+    int h;
+    bool follow;
+    {
+        WriteGuard lock(node->m_mutex);
+        FrameBuffer* fB = FBFind(node, view.frame);
+        if (fB == NULL || fB->size() == 0)
+            return;
+        
+        // Update only on first aov
+        bool first = false;
+        for (size_t p = 0; p < planes.size() && !first; ++p)
+            first = fB->isFirstBufferName(planes[p].name);
+        if (!first)
+            return;
+        
+        // Get framebuffer height
+        h = fB->getHeight();
+        
+        std::map<double, FBMerge>& merges = view.target->merges;
+        follow = merges.size() == 1;
+        
+        // Calculate the progress percentage over the regions of all the
+        // renders of the frame
+        std::map<double, FBMerge>::iterator it = merges.find(view.frame);
+        if (it != merges.end())
+        {
+            FBMerge& merge = it->second;
+            std::map<FBSession*, FBRegion>::iterator region = merge.regions.find(&session);
+            if (region != merge.regions.end())
+            {
+                region->second.received += static_cast<long long>(_width) * _height;
+                region->second.ram = _ram;
+                region->second.time = session.delta_time > _time ? _time : _time - session.delta_time;
+            }
+            
+            fB->setProgress(merge.progress());
+            fB->setRAM(merge.ram());
+            fB->setTime(merge.time());
+        }
+        fB->setQuality(d.quality());
+    }
+    
+    // Update the image
+    const Box box = Box(_x, h - _y - _height, _x + _width, h - _y);
+    if (follow)
+        node->setCurrentFrame(view.frame);
+    node->flagForUpdate(box);
+}
+
+// Finishes a bucket in all the nodes the render is shown in
+static void FBWrite(FBNodes& nodes, FBSession& session, Data& d)
+{
+    boost::shared_lock<boost::shared_mutex> lock(nodes.mutex);
+    std::vector<FBView>::iterator it;
+    for (it = session.views.begin(); it != session.views.end(); ++it)
+        FBWrite(session, *it, d);
+}
+
+// Reports on the image that was received
+static void FBClose(FBNodes& nodes, FBSession& session)
+{
+    boost::shared_lock<boost::shared_mutex> nodesLock(nodes.mutex);
+    if (session.views.empty())
+        return;
+    
+    // Each render of a frame split across machines reports on its region
+    std::vector<FBView>::iterator view;
+    for (view = session.views.begin(); view != session.views.end(); ++view)
+    {
+        ReadGuard lock(view->node->m_mutex);
+        const std::map<double, FBMerge>& merges = view->target->merges;
+        std::map<double, FBMerge>::const_iterator it = merges.find(view->frame);
+        if (it == merges.end() || it->second.regions.size() < 2)
+            continue;
+        
+        std::map<FBSession*, FBRegion>::const_iterator region = it->second.regions.find(&session);
+        if (region != it->second.regions.end())
+        {
+            const FBRegion& r = region->second;
+            view->node->print_name(std::cout);
+            std::cout << ": image " << session.image_id
+                      << " (frame " << view->frame
+                      << "), region " << r.x << "," << r.y
+                      << " " << r.width << "x" << r.height
+                      << " of " << it->second.regions.size()
+                      << ", time " << r.time / 1000.0
+                      << " s, memory " << r.ram / 1048576
+                      << " MB" << std::endl;
+        }
+    }
+    
+    // Report how much smaller the pixels travelled, over all the streams
+    CodecStats stats;
+    int capabilities = 0, skipped = 0;
+    long long allocations = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(session.mutex);
+        std::vector<Connection*>::iterator it;
+        for (it = session.connections.begin(); it != session.connections.end(); ++it)
+        {
+            capabilities |= (*it)->capabilities();
+            stats.add((*it)->stats());
+            skipped += (*it)->skipped();
+            (*it)->resetStats();
+            allocations += (*it)->allocations();
+        }
+    }
+    
+    // Buffers stop growing after the first image
+    const long long grown = std::max(allocations - session.allocations, 0LL);
+    session.allocations = allocations;
+    
+    // Shown in the status bar of the nodes
+    for (view = session.views.begin(); view != session.views.end(); ++view)
+    {
+        WriteGuard lock(view->node->m_mutex);
+        view->node->m_allocations = grown;
+    }
+    
+    // Once, in the node the render went to
+    if (capabilities)
+    {
+        const FBView& view = session.views[0];
+        view.node->print_name(std::cout);
+        std::cout << ": image " << session.image_id
+                  << " (frame " << view.frame
+                  << "), pixels received at " << stats.ratio()
+                  << ":1, decode " << stats.rate() << " MB/s, "
+                  << stats.unchangedBytes() / 1048576.0
+                  << " MB unchanged, " << grown
+                  << " allocations, " << skipped
+                  << " replaced buckets skipped" << std::endl;
+    }
+}
+
+// Port the nodes of a Nuke session listen on, shared by all of them
+// A hub accepts the streams of the renders sent to its port, reads them
+// and writes the pixels with one pool of blit workers, whatever the
+// number of nodes showing them.
+struct FBHub
+{
+    FBHub(): port(0), writer(NULL) {}
+    
+    // Port the first node asked for, the server may have found another
+    int port;
+    
+    Server server;
+    FBNodes nodes;
+    FBSessions sessions;
+    FBBlitPool pool;
+    boost::thread* writer;
+};
+
+// Reads one stream until its Client disconnects,
+// it keeps the connection open between the images it sends.
+// One Data is filled again with every message.
+static void FBReader(FBHub* hub, Connection* connection)
+{
+    // First message is the handshake, or the parent process wanting
+    // to kill the listening thread, which closes the acceptor
+    Data d;
+    try
+    {
+        connection->listen(d);
+    }
+    catch( ... )
+    {
+        hub->server.release(connection);
+        return;
+    }
+    
+    if (d.type() == 9)
+    {
+        hub->server.release(connection);
+        return;
+    }
+    
+    FBSession* session = hub->sessions.join(connection);
+    
+    // Buckets go to the FrameBuffers while they are being received
+    FBSink sink(&hub->nodes, session, &hub->pool);
+    
+    while (true)
+    {
+        // Handle the data we received
+        switch (d.type())
+        {
+            case 0: // Open a new image
+            {
+                if (session->arrive(d.sequence()))
+                {
+                    FBDrain(*session);
                     {
-                        // Get data from d
-                        const int& _x = d.bucket_xo();
-                        const int& _y = d.bucket_yo();
-                        const int& _width = d.bucket_size_x();
-                        const int& _height = d.bucket_size_y();
-                        const int& _spp = d.spp();
-                        const long long& _ram = d.ram();
-                        const int& _time = d.time();
-
-                        // Set active time
-                        _active_time = _time;
-                        
-                        // Get framebuffer width and height
-                        const int& w = fB.getWidth();
-                        const int& h = fB.getHeight();
-
-                        // Adding buffer
-                        node->m_mutex.writeLock();
-                        if(!fB.isBufferExist(_aov_name) && (node->m_enable_aovs || fB.empty()))
-                            fB.addBuffer(_aov_name, _spp);
-                        else
-                            fB.ready(true);
-                        
-                        // Get buffer index
-                        const int b = fB.getBufferIndex(_aov_name);
-                    
-                        // Writing to buffer
-                        int x, y, c, xpos, ypos, offset;
-                        for (x = 0; x < _width; ++x)
-                        {
-                            for (y = 0; y < _height; ++y)
-                            {
-                                offset = (_width * y * _spp) + (x * _spp);
-                                for (c = 0; c < _spp; ++c)
-                                {
-                                    xpos = x + _x;
-                                    ypos = h - (y + _y + 1);
-                                    const float& _pix = d.pixel(offset + c);
-                                    fB.setBufferPix(b, xpos, ypos, _spp, c, _pix);
-                                }
-                            }
-                        }
-                        node->m_mutex.unlock();
-                        
-                        // Update only on first aov
-                        if(!node->m_capturing && fB.isFirstBufferName(_aov_name))
-                        {
-                            // Calculate the progress percentage
-                            regionArea -= (_width*_height);
-                            progress = 100 - (regionArea * 100) / (w * h);
-
-                            // Set status parameters
-                            node->m_mutex.writeLock();
-                            fB.setProgress(progress);
-                            fB.setRAM(_ram);
-                            fB.setTime(_time, delta_time);
-                            node->m_mutex.unlock();
-                            
-                            // Update the image
-                            const Box box = Box(_x, h - _y - _height, _x + _width, h - _y);
-                            node->setCurrentFrame(node->m_current_frame);
-                            node->flagForUpdate(box);
-                        }
+                        boost::shared_lock<boost::shared_mutex> lock(hub->nodes.mutex);
+                        FBOpenImage(hub->nodes, *session, d);
                     }
-                    d.dealloc();
-                    break;
+                    session->done(d.sequence());
                 }
-                case 2: // Close image
+                break;
+            }
+            case 1: // Write image data
+            {
+                FBWrite(hub->nodes, *session, d);
+                break;
+            }
+            case 2: // Close image
+            {
+                if (session->arrive(d.sequence()))
                 {
-                    break;
+                    FBDrain(*session);
+                    FBClose(hub->nodes, *session);
+                    session->done(d.sequence());
                 }
-                case 9: // This is sent when the parent process want to kill
-                        // the listening thread
+                break;
+            }
+        }
+        
+        // Listen for some data
+        try
+        {
+            connection->listen(d, &sink);
+        }
+        catch( ... )
+        {
+            break;
+        }
+    }
+    
+    FBDrain(*session);
+    hub->sessions.leave(hub->nodes, session, connection);
+    hub->server.release(connection);
+}
+
+// Our FrameBuffer writer thread
+// Accepts the connections, and reads each one on its own thread
+static void FBWriter(FBHub* hub)
+{
+    boost::thread_group readers;
+
+    while (true)
+    {
+        // Accept incoming connections!
+        Connection* connection;
+        try
+        {
+            connection = hub->server.accept();
+        }
+        catch( ... )
+        {
+            break;
+        }
+        
+        // Handshakes are read on the reader threads, so a Client that
+        // connects and sends nothing holds up no other
+        readers.create_thread(boost::bind(FBReader, hub, connection));
+        
+        // The parent process wants to kill the listening thread, its
+        // reader gets the quit message
+        if (hub->server.isQuitting())
+            break;
+    }
+    
+    // Wake up the readers of the Clients that connected while we quit
+    hub->server.shutdown();
+    readers.join_all();
+}
+
+// Hubs of the nodes of this Nuke session, by port
+static std::vector<FBHub*> hubs;
+static boost::mutex hubsMutex;
+
+// Adds a node to the hub of a port, starting one if there is none yet,
+// throws if it can't listen on the port
+static FBHub* FBAttach(Aton* node, const int& port)
+{
+    boost::lock_guard<boost::mutex> lock(hubsMutex);
+    
+    FBHub* hub = NULL;
+    for (size_t i = 0; i < hubs.size() && hub == NULL; ++i)
+        if (hubs[i]->port == port || hubs[i]->server.getPort() == port)
+            hub = hubs[i];
+    
+    if (hub == NULL)
+    {
+        hub = new FBHub;
+        try
+        {
+            hub->server.connect(port, true);
+        }
+        catch( ... )
+        {
+            delete hub;
+            throw;
+        }
+        hub->port = port;
+        hub->writer = new boost::thread(boost::bind(FBWriter, hub));
+        hubs.push_back(hub);
+    }
+    
+    boost::unique_lock<boost::shared_mutex> nodesLock(hub->nodes.mutex);
+    hub->nodes.nodes.push_back(new FBNode(node));
+    return hub;
+}
+
+// Takes a node out of its hub, the renders it was showing go on in the
+// nodes following it. The last node to go closes the port.
+static void FBDetach(FBHub* hub, Aton* node)
+{
+    boost::lock_guard<boost::mutex> lock(hubsMutex);
+    {
+        // Waits for the streams to be done with the node
+        boost::unique_lock<boost::shared_mutex> nodesLock(hub->nodes.mutex);
+        
+        std::vector<FBNode*>& nodes = hub->nodes.nodes;
+        std::vector<FBNode*>::iterator it;
+        for (it = nodes.begin(); it != nodes.end(); ++it)
+            if ((*it)->node == node)
+                break;
+        if (it == nodes.end())
+            return;
+        
+        {
+            boost::lock_guard<boost::mutex> sessionsLock(hub->sessions.mutex);
+            std::map<long long, FBSession*>::iterator s;
+            for (s = hub->sessions.sessions.begin(); s != hub->sessions.sessions.end(); ++s)
+            {
+                FBSession* session = s->second;
+                FBDrain(*session);
+                
+                std::vector<FBView>& views = session->views;
+                for (size_t v = 0; v < views.size();)
                 {
-                    killThread = true;
-                    break;
+                    if (views[v].target == *it)
+                        views.erase(views.begin() + v);
+                    else
+                        ++v;
                 }
             }
         }
+        
+        delete *it;
+        nodes.erase(it);
+        if (!nodes.empty())
+            return;
     }
+    
+    hubs.erase(std::find(hubs.begin(), hubs.end(), hub));
+    hub->server.quit();
+    hub->writer->join();
+    delete hub->writer;
+    delete hub;
 }
 
 #endif /* FBWriter_h */
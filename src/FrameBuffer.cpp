@@ -7,6 +7,12 @@ All rights reserved. See COPYING.txt for more details.
 #include "FrameBuffer.h"
 #include "boost/format.hpp"
 #include <boost/lexical_cast.hpp>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define ATON_SSE
+#endif
 
 const std::string chStr::RGBA = "RGBA",
                   chStr::rgb = "rgb",
@@ -22,57 +28,201 @@ const std::string chStr::RGBA = "RGBA",
                   chStr::_Y = ".Y",
                   chStr::_Z = ".Z";
 
-// Lightweight color pixel class
-RenderColor::RenderColor() { _val[0] = _val[1] = _val[2] = 0.0f; }
+// Edge of the tiles until the buckets tell otherwise, and its bounds,
+// as powers of two
+static const int defaultTileShift = 6;
+static const int minTileShift = 4;
+static const int maxTileShift = 10;
 
-float& RenderColor::operator[](int i) { return _val[i]; }
-const float& RenderColor::operator[](int i) const { return _val[i]; }
+// Spreads n pixels of SPP interleaved channels over the channel planes
+// starting at dst, planeSize apart. Specialized for the usual channel
+// counts, the compiler unrolls the others.
+template <int SPP>
+static void deinterleave(const float* src,
+                         float* dst,
+                         const size_t& planeSize,
+                         const unsigned int& n)
+{
+    for (int c = 0; c < SPP; ++c, dst += planeSize)
+    {
+        const float* in = src + c;
+        for (unsigned int k = 0; k < n; ++k, in += SPP)
+            dst[k] = *in;
+    }
+}
 
-void RenderColor::reset() { _val[0] = _val[1] = _val[2] = 0.0f; }
+template <>
+void deinterleave<1>(const float* src,
+                     float* dst,
+                     const size_t&,
+                     const unsigned int& n)
+{
+    memcpy(dst, src, n * sizeof(float));
+}
 
-// RenderBuffer class
-RenderBuffer::RenderBuffer(const unsigned int& width,
-                           const unsigned int& height,
-                           const int& spp)
+#ifdef ATON_SSE
+// Three rows of 4 RGB pixels shuffled into 4 reds, greens and blues
+template <>
+void deinterleave<3>(const float* src,
+                     float* dst,
+                     const size_t& planeSize,
+                     const unsigned int& n)
+{
+    float* r = dst;
+    float* g = r + planeSize;
+    float* b = g + planeSize;
+    
+    unsigned int k = 0;
+    for (; k + 4 <= n; k += 4, src += 12)
+    {
+        const __m128 p0 = _mm_loadu_ps(src);
+        const __m128 p1 = _mm_loadu_ps(src + 4);
+        const __m128 p2 = _mm_loadu_ps(src + 8);
+        
+        const __m128 r1 = _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(1, 1, 2, 2));
+        _mm_storeu_ps(r + k, _mm_shuffle_ps(p0, r1, _MM_SHUFFLE(2, 0, 3, 0)));
+        
+        const __m128 g0 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0, 0, 1, 1));
+        const __m128 g1 = _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(2, 2, 3, 3));
+        _mm_storeu_ps(g + k, _mm_shuffle_ps(g0, g1, _MM_SHUFFLE(2, 0, 2, 0)));
+        
+        const __m128 b0 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(1, 1, 2, 2));
+        const __m128 b1 = _mm_shuffle_ps(p2, p2, _MM_SHUFFLE(3, 3, 0, 0));
+        _mm_storeu_ps(b + k, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+    for (; k < n; ++k, src += 3)
+    {
+        r[k] = src[0];
+        g[k] = src[1];
+        b[k] = src[2];
+    }
+}
+
+// 4 RGBA pixels transposed into 4 reds, greens, blues and alphas
+template <>
+void deinterleave<4>(const float* src,
+                     float* dst,
+                     const size_t& planeSize,
+                     const unsigned int& n)
+{
+    float* r = dst;
+    float* g = r + planeSize;
+    float* b = g + planeSize;
+    float* a = b + planeSize;
+    
+    unsigned int k = 0;
+    for (; k + 4 <= n; k += 4, src += 16)
+    {
+        __m128 p0 = _mm_loadu_ps(src);
+        __m128 p1 = _mm_loadu_ps(src + 4);
+        __m128 p2 = _mm_loadu_ps(src + 8);
+        __m128 p3 = _mm_loadu_ps(src + 12);
+        _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+        _mm_storeu_ps(r + k, p0);
+        _mm_storeu_ps(g + k, p1);
+        _mm_storeu_ps(b + k, p2);
+        _mm_storeu_ps(a + k, p3);
+    }
+    for (; k < n; ++k, src += 4)
+    {
+        r[k] = src[0];
+        g[k] = src[1];
+        b[k] = src[2];
+        a[k] = src[3];
+    }
+}
+#endif
+
+// Same for any channel count, writing the first count channels
+static void deinterleave(const float* src,
+                         const int& spp,
+                         const int& count,
+                         float* dst,
+                         const size_t& planeSize,
+                         const unsigned int& n)
 {
-    const int size = width * height;
+    if (count == spp)
+    {
+        switch (spp)
+        {
+            case 1: deinterleave<1>(src, dst, planeSize, n); return;
+            case 3: deinterleave<3>(src, dst, planeSize, n); return;
+            case 4: deinterleave<4>(src, dst, planeSize, n); return;
+        }
+    }
     
-    switch (spp)
+    for (int c = 0; c < count; ++c, dst += planeSize)
     {
-        case 1: // Float channels
-            _float_data.resize(size);
-            break;
-        case 3: // Color Channels
-            _color_data.resize(size);
-            break;
-        case 4: // Color + Alpha channels
-            _color_data.resize(size);
-            _float_data.resize(size);
-            break;
+        const float* in = src + c;
+        for (unsigned int k = 0; k < n; ++k, in += spp)
+            dst[k] = *in;
     }
 }
 
+// RenderBuffer class
+RenderBuffer::RenderBuffer(const size_t& tiles,
+                           const int& spp): _spp(spp > 0 ? spp : 0),
+                                            _tiles(tiles) {}
+
 // FrameBuffer class
 FrameBuffer::FrameBuffer(const double& currentFrame,
                          const int& w,
                          const int& h): _frame(currentFrame),
-                                        _width(w),
-                                        _height(h),
                                         _progress(0),
                                         _time(0),
                                         _ram(0),
                                         _pram(0),
-                                        _ready(false) {}
+                                        _quality(0),
+                                        _width(w),
+                                        _height(h),
+                                        _tileShift(defaultTileShift),
+                                        _tilesX(0),
+                                        _tilesY(0),
+                                        _tileCount(0),
+                                        _ready(false)
+{
+    resetTiles();
+}
+
 // Add new buffer
 void FrameBuffer::addBuffer(const char* aov,
                             const int& spp)
 {
-    RenderBuffer buffer(_width, _height, spp);
+    RenderBuffer buffer(_tilesX * _tilesY, spp);
     
     _buffers.push_back(buffer);
     _aovs.push_back(aov);
 }
 
+// Allocate the tiles under a bucket
+void FrameBuffer::allocate(const int& b,
+                           const int& x,
+                           const int& y,
+                           const int& width,
+                           const int& height)
+{
+    if (width <= 0 || height <= 0 || x < 0 || y < 0 ||
+        x + width > _width || y + height > _height)
+        return;
+    
+    RenderBuffer& rb = _buffers[b];
+    const size_t tileSize = rb._spp * (static_cast<size_t>(1) << (2 * _tileShift));
+    const size_t first = getTile(x, y + height - 1);
+    const size_t last = getTile(x + width - 1, y);
+    const size_t columns = last % _tilesX - first % _tilesX + 1;
+    for (size_t row = first; row <= last; row += _tilesX)
+    {
+        for (size_t t = row; t < row + columns; ++t)
+        {
+            if (rb._tiles[t].empty())
+            {
+                rb._tiles[t].resize(tileSize);
+                ++_tileCount;
+            }
+        }
+    }
+}
+
 // Get writable buffer object
 void FrameBuffer::setBufferPix(const int& b,
                                const unsigned int& x,
@@ -82,11 +232,58 @@ void FrameBuffer::setBufferPix(const int& b,
                                const float& pix)
 {
     RenderBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && spp != 1)
-        rb._color_data[index][c] = pix;
-    else
-        rb._float_data[index] = pix;
+    const int p = spp == 1 ? 0 : c;
+    std::vector<float>& tile = rb._tiles[getTile(x, y)];
+    if (p < rb._spp && !tile.empty())
+        tile[(static_cast<size_t>(p) << (2 * _tileShift)) + getTexel(x, y)] = pix;
+}
+
+// Write a row of interleaved pixels
+void FrameBuffer::setBufferRow(const int& b,
+                               const unsigned int& x,
+                               const unsigned int& y,
+                               const int& spp,
+                               const float* src,
+                               const unsigned int& width)
+{
+    setBufferBucket(b, x, _height - 1 - y, spp, src, width, 1);
+}
+
+// Write a bucket of interleaved pixels, one channel plane at a time
+// within each tile it crosses. Tiles go top down like the bucket, so
+// its rows are addressed as they come.
+void FrameBuffer::setBufferBucket(const int& b,
+                                  const unsigned int& x,
+                                  const unsigned int& y,
+                                  const int& spp,
+                                  const float* src,
+                                  const unsigned int& width,
+                                  const unsigned int& height)
+{
+    RenderBuffer& rb = _buffers[b];
+    const int count = std::min(spp, rb._spp);
+    const size_t planeSize = static_cast<size_t>(1) << (2 * _tileShift);
+    const unsigned int tileSize = 1u << _tileShift;
+    const unsigned int mask = tileSize - 1;
+    
+    for (unsigned int j = 0; j < height; ++j, src += static_cast<size_t>(width) * spp)
+    {
+        const size_t row = static_cast<size_t>(y) + j;
+        const size_t tileRow = (row >> _tileShift) * _tilesX;
+        const size_t texelRow = (row & mask) << _tileShift;
+        
+        unsigned int i = 0;
+        while (i < width)
+        {
+            const unsigned int px = x + i;
+            const unsigned int run = std::min(width - i, tileSize - (px & mask));
+            std::vector<float>& tile = rb._tiles[tileRow + (px >> _tileShift)];
+            if (!tile.empty())
+                deinterleave(src + static_cast<size_t>(i) * spp, spp, count,
+                             &tile[texelRow + (px & mask)], planeSize, run);
+            i += run;
+        }
+    }
 }
 
 // Get read only buffer object
@@ -95,12 +292,44 @@ const float& FrameBuffer::getBufferPix(const int& b,
                                        const unsigned int& y,
                                        const int& c) const
 {
-    const RenderBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && !rb._color_data.empty())
-        return rb._color_data[index][c];
-    else
-        return rb._float_data[index];
+    static const float zero = 0.0f;
+    const int p = getPlane(b, c);
+    if (p < 0)
+        return zero;
+    
+    const std::vector<float>& tile = _buffers[b]._tiles[getTile(x, y)];
+    if (tile.empty())
+        return zero;
+    return tile[(static_cast<size_t>(p) << (2 * _tileShift)) + getTexel(x, y)];
+}
+
+// Get read only run of a channel
+const float* FrameBuffer::getBufferSpan(const int& b,
+                                        const unsigned int& x,
+                                        const unsigned int& y,
+                                        const int& c,
+                                        unsigned int& length) const
+{
+    const unsigned int tileSize = 1u << _tileShift;
+    length = std::min(tileSize - (x & (tileSize - 1)), _width - x);
+    
+    const int p = getPlane(b, c);
+    if (p < 0)
+        return NULL;
+    
+    const std::vector<float>& tile = _buffers[b]._tiles[getTile(x, y)];
+    if (tile.empty())
+        return NULL;
+    return &tile[(static_cast<size_t>(p) << (2 * _tileShift)) + getTexel(x, y)];
+}
+
+// Get the plane of a channel
+int FrameBuffer::getPlane(const int& b, const int& c) const
+{
+    const int& spp = _buffers[b]._spp;
+    if (spp == 1)
+        return 0;
+    return c >= 0 && c < spp ? c : -1;
 }
 
 // Get the current buffer index
@@ -199,30 +428,44 @@ bool FrameBuffer::isCameraChanged(const float& fov,
     return (_fov != fov || _matrix != matrix);
 }
 
+// Set the edge of the tiles
+void FrameBuffer::setTileSize(const int& size)
+{
+    if (_tileCount > 0)
+        return;
+    
+    int shift = minTileShift;
+    while (shift < maxTileShift && (1 << shift) < size)
+        ++shift;
+    
+    if (shift != _tileShift)
+    {
+        _tileShift = shift;
+        resetTiles();
+    }
+}
+
 // Resize the containers to match the resolution
 void FrameBuffer::setResolution(const unsigned int& w,
                                 const unsigned int& h)
 {
     _width = w;
     _height = h;
+    resetTiles();
+}
+
+// Lay the tiles out for the resolution
+void FrameBuffer::resetTiles()
+{
+    const size_t tileSize = static_cast<size_t>(1) << _tileShift;
+    _tilesX = (std::max(_width, 0) + tileSize - 1) >> _tileShift;
+    _tilesY = (std::max(_height, 0) + tileSize - 1) >> _tileShift;
+    _tileCount = 0;
     
-    const int bfSize = _width * _height;
-    
+    // Swapped out, so that the memory goes with them
     std::vector<RenderBuffer>::iterator iRB;
     for(iRB = _buffers.begin(); iRB != _buffers.end(); ++iRB)
-    {
-        if (!iRB->_color_data.empty())
-        {
-            RenderColor color;
-            std::fill(iRB->_color_data.begin(), iRB->_color_data.end(), color);
-            iRB->_color_data.resize(bfSize);
-        }
-        if (!iRB->_float_data.empty())
-        {
-            std::fill(iRB->_float_data.begin(), iRB->_float_data.end(), 0.0f);
-            iRB->_float_data.resize(bfSize);
-        }
-    }
+        std::vector<std::vector<float> >(_tilesX * _tilesY).swap(iRB->_tiles);
 }
 
 // Clear buffers and aovs
@@ -230,6 +473,7 @@ void FrameBuffer::clearAll()
 {
     _buffers = std::vector<RenderBuffer>();
     _aovs = std::vector<std::string>();
+    _tileCount = 0;
 }
 
 // Check if the given buffer/aov name name is exist
@@ -241,8 +485,15 @@ bool FrameBuffer::isBufferExist(const char* aovName)
 // Resize the buffers
 void FrameBuffer::resize(const size_t& s)
 {
-    _buffers.resize(s);
+    _buffers.resize(s, RenderBuffer(_tilesX * _tilesY));
     _aovs.resize(s);
+    
+    // Count the tiles the buffers kept
+    _tileCount = 0;
+    std::vector<RenderBuffer>::iterator iRB;
+    for(iRB = _buffers.begin(); iRB != _buffers.end(); ++iRB)
+        for (size_t t = 0; t < iRB->_tiles.size(); ++t)
+            _tileCount += !iRB->_tiles[t].empty();
 }
 
 // Set status parameters
@@ -17,34 +17,23 @@ namespace chStr
                              _red, _green, _blue, _X, _Y, _Z;
 }
 
-// Lightweight colour pixel class
-class RenderColor
-{
-    public:
-        RenderColor();
-
-        float& operator[](int i);
-        const float& operator[](int i) const;
-    
-        void reset();
-
-        // Data
-        float _val[3];
-};
-
 // Our image buffer class
+// The image is cut in square tiles, allocated the first time a bucket
+// touches them, so that the memory taken follows the rendered area and
+// not the resolution. Tiles that were never written read as 0. Within a
+// tile every channel is kept in a plane of its own, so that a row of a
+// channel is a contiguous span up to the edge of the tile.
 class RenderBuffer
 {
     friend class FrameBuffer;
     public:
-        RenderBuffer(const unsigned int& width = 0,
-                     const unsigned int& height = 0,
+        RenderBuffer(const size_t& tiles = 0,
                      const int& spp = 0);
     
     private:
-        // Data
-        std::vector<RenderColor> _color_data;
-        std::vector<float> _float_data;
+        // Data, one plane per channel in every tile
+        int _spp;
+        std::vector<std::vector<float> > _tiles;
 };
 
 // Framebuffer main class
@@ -60,6 +49,16 @@ class FrameBuffer
         void addBuffer(const char* aov = NULL,
                        const int& spp = 0);
     
+        // Allocate the tiles of a buffer a bucket of width by height
+        // pixels at x, y touches. Pixels are only written to allocated
+        // tiles, and threads that write to the buffer at the same time
+        // have to allocate them beforehand.
+        void allocate(const int& b,
+                      const int& x,
+                      const int& y,
+                      const int& width,
+                      const int& height);
+    
         // Set writable buffer's pixel
         void setBufferPix(const int& b,
                           const unsigned int& x,
@@ -68,12 +67,43 @@ class FrameBuffer
                           const int& c,
                           const float& pix);
     
+        // Set writable buffer's row of width pixels starting at x, from
+        // interleaved samples of spp channels
+        void setBufferRow(const int& b,
+                          const unsigned int& x,
+                          const unsigned int& y,
+                          const int& spp,
+                          const float* src,
+                          const unsigned int& width);
+    
+        // Set writable buffer's bucket of width by height pixels, from
+        // interleaved samples of spp channels. Its rows go top down from
+        // row y, as the renderer numbers them.
+        void setBufferBucket(const int& b,
+                             const unsigned int& x,
+                             const unsigned int& y,
+                             const int& spp,
+                             const float* src,
+                             const unsigned int& width,
+                             const unsigned int& height);
+    
         // Get read only buffer's pixel
         const float& getBufferPix(const int& b,
                                   const unsigned int& x,
                                   const unsigned int& y,
                                   const int& c) const;
     
+        // Get read only run of a buffer's channel starting at pixel x, y,
+        // setting length to its number of pixels, which end at the edge
+        // of their tile at the latest. Returns NULL if the pixels were
+        // never written or the buffer doesn't have the channel, they read
+        // as 0 then. Single channel buffers answer for every channel.
+        const float* getBufferSpan(const int& b,
+                                   const unsigned int& x,
+                                   const unsigned int& y,
+                                   const int& c,
+                                   unsigned int& length) const;
+    
         // Get the current buffer index
         int getBufferIndex(const Channel& z);
     
@@ -99,6 +129,11 @@ class FrameBuffer
         // Check if Camera fov has been changed
         bool isCameraChanged(const float& fov, const Matrix4& matrix);
     
+        // Set the edge of the tiles, rounded up to a power of two
+        // Only done while no tile is allocated, the buffers keep their
+        // tiles otherwise.
+        void setTileSize(const int& size);
+    
         // Resize the containers to match the resolution
         void setResolution(const unsigned int& w,
                            const unsigned int& h);
@@ -126,12 +161,14 @@ class FrameBuffer
         void setRAM(const long long& ram = 0);
         void setTime(const int& time = 0,
                      const int& dtime = 0);
+        void setQuality(const int& quality = 0) { _quality = quality; }
     
         // Get status parameters
         const long long& getProgress() { return _progress; }
         const long long& getRAM() { return _ram; }
         const long long& getPRAM() { return _pram; }
         const int& getTime() { return _time; }
+        const int& getQuality() { return _quality; }
     
         // Set Arnold core version
         void setAiVersion(const int& version);
@@ -161,13 +198,38 @@ class FrameBuffer
         void setCamera(const float& fov, const Matrix4& matrix);
     
     private:
+        // Plane of a buffer's channel, -1 if it doesn't have it
+        int getPlane(const int& b, const int& c) const;
+    
+        // Tile holding pixel x, y and the index of the pixel within a
+        // plane of it, tiles going top down like the buckets
+        size_t getTile(const unsigned int& x, const unsigned int& y) const
+        {
+            return ((static_cast<size_t>(_height) - 1 - y) >> _tileShift) * _tilesX + (x >> _tileShift);
+        }
+        size_t getTexel(const unsigned int& x, const unsigned int& y) const
+        {
+            const size_t mask = (static_cast<size_t>(1) << _tileShift) - 1;
+            return (((static_cast<size_t>(_height) - 1 - y) & mask) << _tileShift) + (x & mask);
+        }
+    
+        // Drop all the tiles and lay them out for the resolution
+        void resetTiles();
+    
         double _frame;
         long long _progress;
         int _time;
         long long _ram;
         long long _pram;
+        int _quality;
         int _width;
         int _height;
+        // Edge of the tiles as a power of two, tiles across and down,
+        // and the number allocated in all the buffers
+        int _tileShift;
+        size_t _tilesX;
+        size_t _tilesY;
+        size_t _tileCount;
         bool _ready;
         float _fov;
         Matrix4 _matrix;
@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_QUEUE_H_
+#define ATON_QUEUE_H_
+
+#include <vector>
+#include <cstddef>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Adds value to a counter shared between threads, returns the new count
+inline int atomicAdd(volatile int* counter, const int& value)
+{
+#ifdef _WIN32
+    return InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(counter), value) + value;
+#else
+    return __sync_add_and_fetch(counter, value);
+#endif
+}
+
+// Bounded queue that any number of threads can push to and pop from
+// without taking a lock. Every cell carries a sequence number telling
+// whether it is free for the next push or holds the value for the next
+// pop, so threads only compete for the head or tail index they move.
+// Neither side blocks, push() and pop() fail when the queue is full or
+// empty and it is up to the caller to wait and retry.
+template <typename T>
+class Queue
+{
+public:
+    // Holds at least capacity values, rounded up to a power of two
+    explicit Queue(const size_t& capacity): mHead(0), mTail(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+
+        mCells.resize(size);
+        mMask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+            mCells[i].sequence = i;
+    }
+
+    // Returns false if the queue is full
+    bool push(const T& value)
+    {
+        size_t head = mHead;
+        Cell* cell;
+        while (true)
+        {
+            cell = &mCells[head & mMask];
+            const size_t sequence = cell->sequence;
+            barrier();
+
+            const ptrdiff_t diff = static_cast<ptrdiff_t>(sequence - head);
+            if (diff == 0)
+            {
+                // Free, try to take it
+                if (compareAndSwap(&mHead, head, head + 1))
+                    break;
+                head = mHead;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                head = mHead;
+        }
+
+        cell->value = value;
+
+        // Publish the value before handing the cell to pop()
+        barrier();
+        cell->sequence = head + 1;
+        return true;
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T& value)
+    {
+        size_t tail = mTail;
+        Cell* cell;
+        while (true)
+        {
+            cell = &mCells[tail & mMask];
+            const size_t sequence = cell->sequence;
+            barrier();
+
+            const ptrdiff_t diff = static_cast<ptrdiff_t>(sequence - (tail + 1));
+            if (diff == 0)
+            {
+                // Filled, try to take it
+                if (compareAndSwap(&mTail, tail, tail + 1))
+                    break;
+                tail = mTail;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                tail = mTail;
+        }
+
+        value = cell->value;
+
+        // Done with the value before handing the cell back to push()
+        barrier();
+        cell->sequence = tail + mMask + 1;
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        volatile size_t sequence;
+        T value;
+    };
+
+    static void barrier()
+    {
+#ifdef _WIN32
+        MemoryBarrier();
+#else
+        __sync_synchronize();
+#endif
+    }
+
+    static bool compareAndSwap(volatile size_t* target, const size_t& expected, const size_t& desired)
+    {
+#ifdef _WIN32
+        return InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile*>(target),
+                                                 reinterpret_cast<PVOID>(desired),
+                                                 reinterpret_cast<PVOID>(expected)) == reinterpret_cast<PVOID>(expected);
+#else
+        return __sync_bool_compare_and_swap(target, expected, desired);
+#endif
+    }
+
+    std::vector<Cell> mCells;
+    size_t mMask;
+
+    // Kept on their own cache lines, pushing and popping threads
+    // don't slow each other down
+    char mPad0[64];
+    volatile size_t mHead;
+    char mPad1[64];
+    volatile size_t mTail;
+    char mPad2[64];
+};
+
+#endif // ATON_QUEUE_H_
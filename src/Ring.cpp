@@ -0,0 +1,311 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "Ring.h"
+#include <cstring>
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+
+#ifndef _WIN32
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+Ring::Ring(): mHeader(NULL),
+              mData(NULL),
+              mMapSize(0),
+              mHeld(0),
+              mIsOwner(false),
+              mIsLinked(false)
+{
+}
+
+Ring::~Ring()
+{
+    close();
+}
+
+#ifndef _WIN32
+
+// Tries that only yield before a side goes to sleep, and how long it
+// sleeps at most before it looks again
+static const int spinCount = 64;
+static const int sleepTime = 10;
+
+// Sleeps while events still holds value, the futex is shared with the
+// other process. Without futexes we sleep for a while and look again.
+static void sleepOn(volatile int* events, const int& value)
+{
+#ifdef __linux__
+    struct timespec timeout = { 0, sleepTime * 1000000L };
+    syscall(SYS_futex, events, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+    usleep(1000);
+#endif
+}
+
+// Counts a move of one side, and wakes up the other if it sleeps on it
+static void moved(volatile int* events, volatile int* waiting)
+{
+    __sync_add_and_fetch(events, 1);
+#ifdef __linux__
+    if (*waiting)
+        syscall(SYS_futex, events, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+bool Ring::create(const size_t& capacity)
+{
+    close();
+
+    // Unique per process and per buffer
+    static int count = 0;
+    const std::string name = "/aton." + boost::lexical_cast<std::string>(getpid()) +
+                             "." + boost::lexical_cast<std::string>(__sync_add_and_fetch(&count, 1));
+
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return false;
+
+    const size_t size = sizeof(Header) + capacity;
+    if (ftruncate(fd, size) != 0 || !map(fd, size))
+    {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    ::close(fd);
+
+    mHeader->head = 0;
+    mHeader->tail = 0;
+    mHeader->capacity = capacity;
+    mHeader->writes = mHeader->reads = 0;
+    mHeader->readerWaiting = mHeader->writerWaiting = 0;
+    mName = name;
+    mIsOwner = mIsLinked = true;
+    return true;
+}
+
+bool Ring::open(const std::string& name)
+{
+    close();
+
+    const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    const bool mapped = fstat(fd, &st) == 0 &&
+                        static_cast<size_t>(st.st_size) > sizeof(Header) &&
+                        map(fd, st.st_size);
+    ::close(fd);
+
+    if (!mapped || mHeader->capacity != mMapSize - sizeof(Header))
+    {
+        close();
+        return false;
+    }
+
+    mName = name;
+    return true;
+}
+
+void Ring::close()
+{
+    if (mHeader != NULL)
+        munmap(mHeader, mMapSize);
+    unlink();
+
+    mHeader = NULL;
+    mData = NULL;
+    mMapSize = 0;
+    mHeld = 0;
+    mIsOwner = false;
+    mName.clear();
+}
+
+void Ring::unlink()
+{
+    if (mIsOwner && mIsLinked)
+        shm_unlink(mName.c_str());
+    mIsLinked = false;
+}
+
+bool Ring::map(const int& fd, const size_t& size)
+{
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    mHeader = static_cast<Header*>(memory);
+    mData = static_cast<char*>(memory) + sizeof(Header);
+    mMapSize = size;
+    return true;
+}
+
+void Ring::waitToRead(const int& idle)
+{
+    if (idle < spinCount)
+    {
+        sched_yield();
+        return;
+    }
+    
+    // Writer counts its moves before it looks whether we sleep
+    mHeader->readerWaiting = 1;
+    const int writes = __sync_add_and_fetch(&mHeader->writes, 0);
+    if (mHeader->head == mHeader->tail + mHeld)
+        sleepOn(&mHeader->writes, writes);
+    mHeader->readerWaiting = 0;
+}
+
+void Ring::waitToWrite(const int& idle)
+{
+    if (idle < spinCount)
+    {
+        sched_yield();
+        return;
+    }
+    
+    mHeader->writerWaiting = 1;
+    const int reads = __sync_add_and_fetch(&mHeader->reads, 0);
+    if (mHeader->head - mHeader->tail == mHeader->capacity)
+        sleepOn(&mHeader->reads, reads);
+    mHeader->writerWaiting = 0;
+}
+
+size_t Ring::write(const void* src, const size_t& size)
+{
+    const size_t capacity = mHeader->capacity;
+    const size_t head = mHeader->head;
+
+    // See how far the reader got before touching its bytes
+    __sync_synchronize();
+    const size_t tail = mHeader->tail;
+
+    const size_t n = std::min(capacity - (head - tail), size);
+    const size_t at = head % capacity;
+    const size_t first = std::min(n, capacity - at);
+    memcpy(mData + at, src, first);
+    memcpy(mData, static_cast<const char*>(src) + first, n - first);
+
+    // Publish the bytes before moving the head
+    __sync_synchronize();
+    mHeader->head = head + n;
+    if (n > 0)
+        moved(&mHeader->writes, &mHeader->readerWaiting);
+    return n;
+}
+
+size_t Ring::read(void* dst, const size_t& size)
+{
+    release();
+    
+    const size_t capacity = mHeader->capacity;
+    const size_t tail = mHeader->tail;
+
+    // See how far the writer got before touching its bytes
+    __sync_synchronize();
+    const size_t head = mHeader->head;
+
+    const size_t n = std::min(head - tail, size);
+    const size_t at = tail % capacity;
+    const size_t first = std::min(n, capacity - at);
+    memcpy(dst, mData + at, first);
+    memcpy(static_cast<char*>(dst) + first, mData, n - first);
+
+    // Done with the bytes before handing them back to the writer
+    __sync_synchronize();
+    mHeader->tail = tail + n;
+    if (n > 0)
+        moved(&mHeader->reads, &mHeader->writerWaiting);
+    return n;
+}
+
+bool Ring::peek(const size_t& offset, void* dst, const size_t& size)
+{
+    release();
+    
+    const size_t capacity = mHeader->capacity;
+    const size_t tail = mHeader->tail;
+
+    // See how far the writer got before touching its bytes
+    __sync_synchronize();
+    const size_t head = mHeader->head;
+
+    if (head - tail < offset + size)
+        return false;
+
+    const size_t at = (tail + offset) % capacity;
+    const size_t first = std::min(size, capacity - at);
+    memcpy(dst, mData + at, first);
+    memcpy(static_cast<char*>(dst) + first, mData, size - first);
+    return true;
+}
+
+const char* Ring::view(const size_t& size)
+{
+    release();
+    
+    const size_t tail = mHeader->tail;
+    
+    // See how far the writer got before touching its bytes
+    __sync_synchronize();
+    const size_t head = mHeader->head;
+    
+    if (head - tail < size || wraps(size))
+        return NULL;
+    
+    mHeld = size;
+    return mData + tail % mHeader->capacity;
+}
+
+bool Ring::wraps(const size_t& size) const
+{
+    const size_t capacity = mHeader->capacity;
+    return size > capacity - (mHeader->tail + mHeld) % capacity;
+}
+
+void Ring::release()
+{
+    if (mHeld == 0)
+        return;
+    
+    // Done with the bytes before handing them back to the writer
+    __sync_synchronize();
+    mHeader->tail += mHeld;
+    mHeld = 0;
+    moved(&mHeader->reads, &mHeader->writerWaiting);
+}
+
+#else
+
+bool Ring::create(const size_t& capacity) { return false; }
+bool Ring::open(const std::string& name) { return false; }
+void Ring::close() {}
+void Ring::unlink() {}
+bool Ring::map(const int& fd, const size_t& size) { return false; }
+size_t Ring::write(const void* src, const size_t& size) { return 0; }
+size_t Ring::read(void* dst, const size_t& size) { return 0; }
+bool Ring::peek(const size_t& offset, void* dst, const size_t& size) { return false; }
+const char* Ring::view(const size_t& size) { return NULL; }
+bool Ring::wraps(const size_t& size) const { return true; }
+void Ring::waitToRead(const int& idle) {}
+void Ring::waitToWrite(const int& idle) {}
+void Ring::release() {}
+
+#endif
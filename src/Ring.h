@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_RING_H_
+#define ATON_RING_H_
+
+#include <string>
+#include <cstddef>
+
+// Byte stream between two processes on the same host
+// A Ring is a single producer, single consumer circular buffer living in
+// POSIX shared memory. The Server creates it and the Client maps it by
+// name, after that messages flow through it without any system calls
+// while both sides keep up. read() and write() return how much they
+// managed to move, the caller waits with waitToRead() or waitToWrite()
+// and retries. Waiting sides sleep on a futex in the shared memory,
+// and the other side only wakes them up if they do.
+// Not available on Windows, where create() and open() always fail.
+class Ring
+{
+public:
+    Ring();
+
+    // Unmaps the buffer, and removes it if we created it
+    ~Ring();
+
+    // Creates a new shared buffer of capacity bytes under a unique name
+    bool create(const size_t& capacity);
+
+    // Maps a shared buffer created by another process
+    bool open(const std::string& name);
+
+    // Unmaps the buffer, and removes it if we created it
+    void close();
+
+    // Removes the name of the buffer, it stays mapped until close()
+    void unlink();
+
+    // Copies up to size bytes into the ring, returns how many were copied
+    size_t write(const void* src, const size_t& size);
+
+    // Copies up to size bytes out of the ring, returns how many were copied
+    size_t read(void* dst, const size_t& size);
+
+    // Copies size bytes found offset bytes past the next one to read,
+    // leaving them in the ring. Returns false if they are not all there yet.
+    bool peek(const size_t& offset, void* dst, const size_t& size);
+
+    // Returns where the next size bytes are, if they are all there and
+    // don't wrap around, NULL otherwise. They are read, but stay where
+    // they are until the next read(), peek() or view().
+    const char* view(const size_t& size);
+
+    // Whether the next size bytes wrap around, view() never gets them
+    bool wraps(const size_t& size) const;
+
+    bool isOpen() const { return mHeader != NULL; }
+
+    // Wait while the other side catches up, idle being the number of
+    // consecutive tries that moved nothing. Spin at first, then sleep
+    // until the other side moves or a few milliseconds went by.
+    void waitToRead(const int& idle);
+    void waitToWrite(const int& idle);
+
+    const std::string& name() const { return mName; }
+
+private:
+    // Lives at the start of the shared memory, followed by the data
+    struct Header
+    {
+        volatile size_t head;
+        volatile size_t tail;
+        size_t capacity;
+        
+        // Times each side moved, and whether the other one sleeps on it
+        volatile int writes, reads;
+        volatile int readerWaiting, writerWaiting;
+    };
+
+    bool map(const int& fd, const size_t& size);
+
+    // Hands the bytes of the last view() back to the writer
+    void release();
+
+    Header* mHeader;
+    char* mData;
+    size_t mMapSize, mHeld;
+    std::string mName;
+    bool mIsOwner, mIsLinked;
+};
+
+#endif // ATON_RING_H_
@@ -0,0 +1,512 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "Sender.h"
+#include <cstdio>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace boost::posix_time;
+
+Sender::Sender(std::string hostname,
+               int port,
+               int capabilities,
+               size_t capacity,
+               int streams): mCapacity(capacity),
+                             mDepth(0),
+                             mSequence(0),
+                             mQuit(false),
+                             mQuality(QUALITY_FULL),
+                             mPrimaryAov(0),
+                             mSinceChange(0),
+                             mSentBytes(0),
+                             mSendTime(0),
+                             mPeakDepth(0),
+                             mStalls(0),
+                             mStallTime(0)
+{
+    streams = std::max(streams, 1);
+    
+    // Tells our streams apart from the ones of other renders, positive
+    // since the Server numbers single stream renders below zero
+    const ptime now = microsec_clock::universal_time();
+    const unsigned long long micros = (now - ptime(boost::gregorian::date(1970, 1, 1))).total_microseconds();
+    const unsigned long long address = reinterpret_cast<size_t>(this);
+    const long long session = static_cast<long long>((micros ^ (address << 20)) & 0x7fffffffffffffffULL);
+    
+    for (int i = 0; i < streams; ++i)
+    {
+        Stream* stream = new Stream(hostname, port, capabilities);
+        if (streams > 1)
+            stream->client.setStream(session, i, streams);
+        mStreams.push_back(stream);
+    }
+    
+    for (int i = 0; i < streams; ++i)
+        mStreams[i]->thread = boost::thread(boost::bind(&Sender::run, this, i));
+}
+
+Sender::~Sender()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        mQuit = true;
+    }
+    mNotEmpty.notify_all();
+    
+    std::vector<Stream*>::iterator it;
+    for (it = mStreams.begin(); it != mStreams.end(); ++it)
+        (*it)->thread.join();
+    
+    for (it = mStreams.begin(); it != mStreams.end(); ++it)
+    {
+        std::map<std::pair<int, int>, Message*>::iterator rit;
+        for (rit = (*it)->refine.begin(); rit != (*it)->refine.end(); ++rit)
+            delete rit->second;
+        delete *it;
+    }
+
+    std::vector<Message*>::iterator mit;
+    for (mit = mFree.begin(); mit != mFree.end(); ++mit)
+        delete *mit;
+}
+
+void Sender::openImage(Data& header)
+{
+    const int camMatrixSize = 16;
+
+    Message* message = acquire();
+    message->data = header;
+    message->data.mType = 0;
+    message->camMatrix.assign(header.mCamMatrix, header.mCamMatrix + camMatrixSize);
+    message->data.mCamMatrix = &message->camMatrix[0];
+    
+    // The beauty is the first colour AOV, that's what is kept when the
+    // link can't take all of them
+    int primary = 0;
+    for (size_t i = 0; i < header.mAovs.size(); ++i)
+    {
+        if (header.mAovs[i].spp > 1)
+        {
+            primary = static_cast<int>(i);
+            break;
+        }
+    }
+    
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        mPrimaryAov = primary;
+        
+        // Whatever is left belongs to the previous image
+        std::vector<Stream*>::iterator it;
+        for (it = mStreams.begin(); it != mStreams.end(); ++it)
+        {
+            std::map<std::pair<int, int>, Message*>::iterator rit;
+            for (rit = (*it)->refine.begin(); rit != (*it)->refine.end(); ++rit)
+                release(rit->second);
+            (*it)->refine.clear();
+        }
+    }
+    push(message, -1);
+}
+
+void Sender::sendPixels(Data& data)
+{
+    int quality;
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        quality = mQuality;
+    }
+    
+    Message* message = acquire();
+    copy(data, quality, message);
+    
+    // Keep the full bucket for when the link catches up
+    Message* full = NULL;
+    if (quality != QUALITY_FULL)
+    {
+        full = acquire();
+        copy(data, QUALITY_FULL, full);
+    }
+    
+    const int stream = route(data.mBucket_xo, data.mBucket_yo);
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        
+        // Newer pixels of the same bucket replace the ones waiting
+        std::map<std::pair<int, int>, Message*>& refine = mStreams[stream]->refine;
+        const std::pair<int, int> key(data.mBucket_xo, data.mBucket_yo);
+        std::map<std::pair<int, int>, Message*>::iterator it = refine.find(key);
+        if (it != refine.end())
+        {
+            release(it->second);
+            refine.erase(it);
+        }
+        if (full != NULL)
+            refine[key] = full;
+    }
+    push(message, stream);
+}
+
+void Sender::copy(const Data& data, const int& quality, Message* message)
+{
+    message->data = data;
+    message->data.mType = 1;
+    message->data.mQuality = quality;
+    
+    std::vector<Plane>& planes = message->data.mPlanes;
+    
+    // Only the primary AOV, or the first plane if the bucket doesn't have it
+    if (quality >= QUALITY_PRIMARY && planes.size() > 1)
+    {
+        size_t keep = 0;
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            if (planes[i].aov == mPrimaryAov)
+            {
+                keep = i;
+                break;
+            }
+        }
+        planes[0] = planes[keep];
+        planes.resize(1);
+    }
+    
+    // Colour planes go one precision lower, integer AOVs are never colour
+    std::vector<Plane>::iterator it;
+    if (quality >= QUALITY_LOW)
+    {
+        for (it = planes.begin(); it != planes.end(); ++it)
+            if (it->spp > 1)
+                it->precision = std::min(it->precision + 1, static_cast<int>(Codec::Preview));
+    }
+    
+    const int step = quality >= QUALITY_SUBSAMPLED ? 2 : 1;
+    const int width = data.mBucket_size_x;
+    const int height = data.mBucket_size_y;
+    const int num_pixels = Codec::subsampledSize(width, step) *
+                           Codec::subsampledSize(height, step);
+    message->data.mSubsample = step;
+    
+    // Copy all the planes back to back, then point them at their copies
+    size_t size = 0;
+    for (it = planes.begin(); it != planes.end(); ++it)
+        size += num_pixels * it->spp;
+    message->pixels.resize(size);
+    
+    size_t offset = 0;
+    for (it = planes.begin(); it != planes.end(); ++it)
+    {
+        const size_t num_samples = num_pixels * it->spp;
+        float* dst = &message->pixels[offset];
+        if (step == 1)
+            std::copy(it->data, it->data + num_samples, dst);
+        else
+            Codec::subsample(it->data, width, height, it->spp, step, dst);
+        it->data = dst;
+        offset += num_samples;
+    }
+}
+
+int Sender::route(const int& x, const int& y) const
+{
+    const unsigned int hash = static_cast<unsigned int>(x) * 73856093u ^
+                              static_cast<unsigned int>(y) * 19349663u;
+    return static_cast<int>(hash % mStreams.size());
+}
+
+void Sender::closeImage()
+{
+    // Degraded buckets go again at full quality before the image closes
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        std::vector<Stream*>::iterator it;
+        for (it = mStreams.begin(); it != mStreams.end(); ++it)
+        {
+            std::map<std::pair<int, int>, Message*>::iterator rit;
+            for (rit = (*it)->refine.begin(); rit != (*it)->refine.end(); ++rit)
+            {
+                rit->second->data.mSequence = ++mSequence;
+                (*it)->queue.push_back(rit->second);
+                ++mDepth;
+            }
+            (*it)->refine.clear();
+        }
+    }
+    
+    Message* message = acquire();
+    message->data.mType = 2;
+    push(message, -1);
+
+    // Wait until the whole image went out
+    boost::unique_lock<boost::mutex> lock(mMutex);
+    while (!drained())
+        mDrained.wait(lock);
+}
+
+CodecStats Sender::codecStats() const
+{
+    CodecStats stats;
+    std::vector<Stream*>::const_iterator it;
+    for (it = mStreams.begin(); it != mStreams.end(); ++it)
+        stats.add((*it)->client.stats());
+    return stats;
+}
+
+size_t Sender::peakDepth()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    return mPeakDepth;
+}
+
+int Sender::stalls()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    return mStalls;
+}
+
+double Sender::stallTime()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    return mStallTime;
+}
+
+void Sender::resetStats()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    mPeakDepth = 0;
+    mStalls = 0;
+    mStallTime = 0;
+    
+    std::vector<Stream*>::iterator it;
+    for (it = mStreams.begin(); it != mStreams.end(); ++it)
+        (*it)->client.resetStats();
+}
+
+std::string Sender::error()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    std::string error;
+    error.swap(mError);
+    return error;
+}
+
+int Sender::quality()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    return mQuality;
+}
+
+double Sender::throughput()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    
+    // Streams send side by side
+    return mSendTime > 0 ? mStreams.size() * (mSentBytes / 1048576.0) / (mSendTime / 1000000.0) : 0.0;
+}
+
+std::vector<std::string> Sender::events()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    std::vector<std::string> events;
+    events.swap(mEvents);
+    return events;
+}
+
+Sender::Message* Sender::acquire()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    if (mFree.empty())
+    {
+        Message* message = new Message;
+        message->refs = 1;
+        return message;
+    }
+
+    Message* message = mFree.back();
+    mFree.pop_back();
+    message->refs = 1;
+    return message;
+}
+
+void Sender::release(Message* message)
+{
+    if (--message->refs <= 0)
+        mFree.push_back(message);
+}
+
+void Sender::push(Message* message, const int& stream)
+{
+    boost::unique_lock<boost::mutex> lock(mMutex);
+
+    // Render thread would have blocked on the network here
+    if (mDepth >= mCapacity)
+    {
+        const ptime start = microsec_clock::universal_time();
+        while (mDepth >= mCapacity)
+            mNotFull.wait(lock);
+
+        mStalls++;
+        mStallTime += (microsec_clock::universal_time() - start).total_microseconds() / 1000.0;
+    }
+    
+    // Numbered here so that they go up in every queue
+    message->data.mSequence = ++mSequence;
+    
+    if (stream < 0)
+    {
+        message->refs = static_cast<int>(mStreams.size());
+        std::vector<Stream*>::iterator it;
+        for (it = mStreams.begin(); it != mStreams.end(); ++it)
+            (*it)->queue.push_back(message);
+        mDepth += mStreams.size();
+    }
+    else
+    {
+        message->refs = 1;
+        mStreams[stream]->queue.push_back(message);
+        ++mDepth;
+    }
+    
+    if (mDepth > mPeakDepth)
+        mPeakDepth = mDepth;
+    
+    if (message->data.type() == 1)
+        adapt();
+
+    mNotEmpty.notify_all();
+}
+
+bool Sender::drained() const
+{
+    std::vector<Stream*>::const_iterator it;
+    for (it = mStreams.begin(); it != mStreams.end(); ++it)
+        if (!(*it)->queue.empty() || (*it)->busy)
+            return false;
+    return true;
+}
+
+void Sender::adapt()
+{
+    // Give the last change time to show
+    if (++mSinceChange < static_cast<int>(std::max(mCapacity / 4, size_t(1))))
+        return;
+    
+    if (mDepth * 4 >= mCapacity * 3 && mQuality < QUALITY_SUBSAMPLED)
+        setQuality(mQuality + 1);
+    else if (mDepth * 8 <= mCapacity && mQuality > QUALITY_FULL)
+        setQuality(mQuality - 1);
+}
+
+void Sender::setQuality(const int& quality)
+{
+    const double rate = mSendTime > 0 ? mStreams.size() * (mSentBytes / 1048576.0) / (mSendTime / 1000000.0) : 0.0;
+    
+    char event[128];
+    sprintf(event, "link %s to %s (queue %d/%d, %.1f MB/s)",
+            quality > mQuality ? "degraded" : "restored",
+            qualityName(quality),
+            static_cast<int>(mDepth),
+            static_cast<int>(mCapacity),
+            rate);
+    mEvents.push_back(event);
+    
+    mQuality = quality;
+    mSinceChange = 0;
+}
+
+void Sender::run(const int& index)
+{
+    Stream& stream = *mStreams[index];
+    Client& client = stream.client;
+    
+    // Set when the connection failed, pixels are dropped until the next open
+    bool failed = false;
+
+    boost::unique_lock<boost::mutex> lock(mMutex);
+    while (true)
+    {
+        // Full quality copies wait until the stream is idle
+        while (stream.queue.empty() && !mQuit && (mQuality != QUALITY_FULL || stream.refine.empty()))
+            mNotEmpty.wait(lock);
+
+        Message* message;
+        if (!stream.queue.empty())
+        {
+            message = stream.queue.front();
+            stream.queue.pop_front();
+            --mDepth;
+        }
+        else if (mQuit) // Only quit once everything has been sent
+            break;
+        else
+        {
+            message = stream.refine.begin()->second;
+            stream.refine.erase(stream.refine.begin());
+            message->data.mSequence = ++mSequence;
+        }
+        stream.busy = true;
+        
+        // Buckets held back for a batch go out once we run dry
+        const bool last = stream.queue.empty();
+        mNotFull.notify_all();
+        lock.unlock();
+
+        std::string error;
+        double us = 0;
+        try
+        {
+            switch (message->data.type())
+            {
+                case 0:
+                    failed = false;
+                    client.openImage(message->data);
+                    break;
+                case 1:
+                    if (!failed)
+                    {
+                        const ptime start = microsec_clock::universal_time();
+                        client.sendPixels(message->data);
+                        if (last)
+                            client.flush();
+                        us = static_cast<double>((microsec_clock::universal_time() - start).total_microseconds());
+                    }
+                    break;
+                case 2:
+                    if (!failed)
+                        client.closeImage(message->data.mSequence);
+                    break;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            failed = true;
+            error = e.what();
+        }
+
+        lock.lock();
+        if (!error.empty())
+            mError = error;
+        
+        // Recent messages weigh more
+        if (us > 0)
+        {
+            mSentBytes = mSentBytes * 0.99 + message->pixels.size() * sizeof(float);
+            mSendTime = mSendTime * 0.99 + us;
+        }
+
+        stream.busy = false;
+        release(message);
+        if (drained())
+        {
+            // Link caught up, see if we can go back up
+            if (mQuality != QUALITY_FULL)
+                adapt();
+            mDrained.notify_all();
+        }
+    }
+}
@@ -0,0 +1,184 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SENDER_H_
+#define ATON_SENDER_H_
+
+#include "Client.h"
+#include <map>
+#include <deque>
+#include <boost/thread.hpp>
+
+// Sends images to a Server from background threads
+// The Sender owns one Client per stream, each with its own thread and
+// queue of messages. openImage(), sendPixels() and closeImage() copy what
+// they are given into the queues and return straight away, so the render
+// threads never wait on the network unless the queues are full.
+// closeImage() returns once the queues have been drained.
+// Buckets always go through the same stream for a given position, image
+// open and close messages go through all of them with the same sequence
+// number, so the Server can apply them once all the streams got there.
+// When the queues keep filling up the link is slower than the render, so
+// the Sender degrades the buckets it queues one Quality level at a time,
+// and goes back up once the queues empty. A full copy of every degraded
+// bucket is kept and sent whenever its stream is idle, and at the latest
+// by closeImage().
+class Sender
+{
+public:
+    // Creates a new Sender for the given host/port, that holds at most
+    // capacity messages before the calling thread has to wait, over the
+    // given number of streams. capabilities are passed on to the Clients.
+    Sender(std::string hostname,
+           int port,
+           int capabilities = 0,
+           size_t capacity = 256,
+           int streams = 1);
+
+    // Flushes whatever is left in the queues and stops the sender threads
+    ~Sender();
+
+    // Queues an image open message
+    void openImage(Data& header);
+
+    // Copies the pixels of all the bucket planes and queues them
+    void sendPixels(Data& data);
+
+    // Queues an image close message and waits until it has been sent
+    void closeImage();
+
+    // Host and port this Sender sends its images to
+    const std::string& host() const { return mStreams[0]->client.host(); }
+    const int& port() const { return mStreams[0]->client.port(); }
+    
+    // Capabilities asked for and the ones the Server agreed to
+    const int& capabilities() const { return mStreams[0]->client.capabilities(); }
+    const int& negotiated() const { return mStreams[0]->client.negotiated(); }
+    
+    // Number of parallel streams
+    int streams() const { return static_cast<int>(mStreams.size()); }
+    
+    // Compression statistics of all the streams, only valid once
+    // closeImage() returned
+    CodecStats codecStats() const;
+
+    // Maximum number of messages waiting in the queues
+    const size_t& capacity() const { return mCapacity; }
+
+    // Highest number of messages that were waiting since resetStats()
+    size_t peakDepth();
+
+    // How many times and for how long sendPixels() had to wait for room
+    // in the queues since resetStats()
+    int stalls();
+    double stallTime();
+
+    // Resets the queue and compression statistics
+    void resetStats();
+
+    // Returns and clears the last error from the sender threads
+    std::string error();
+    
+    // Quality level the buckets are currently queued at
+    int quality();
+    
+    // Pixel throughput of the link in MB/s, measured by the sender threads
+    double throughput();
+    
+    // Returns and clears the quality changes since the last call
+    std::vector<std::string> events();
+
+private:
+    // A queued message that owns copies of everything it points to
+    // Open and close messages are shared by all the streams.
+    struct Message
+    {
+        Data data;
+        std::vector<float> pixels;
+        std::vector<float> camMatrix;
+        int refs;
+    };
+    
+    // A Client with its thread and queue
+    struct Stream
+    {
+        Stream(const std::string& hostname,
+               const int& port,
+               const int& capabilities): client(hostname, port, capabilities),
+                                         busy(false) {}
+        
+        Client client;
+        std::deque<Message*> queue;
+        
+        // Full quality copies of the buckets sent degraded, per position
+        std::map<std::pair<int, int>, Message*> refine;
+        
+        // Set while the thread is writing a message
+        bool busy;
+        
+        boost::thread thread;
+    };
+
+    // Takes a recycled message, or makes a new one
+    Message* acquire();
+    
+    // Gives a message back once all its streams are done with it,
+    // called with the mutex held
+    void release(Message* message);
+    
+    // Copies the bucket into message at the given quality
+    void copy(const Data& data, const int& quality, Message* message);
+    
+    // Stream the buckets at the given position go through
+    int route(const int& x, const int& y) const;
+
+    // Puts the message in the queue of a stream, or of all of them if
+    // stream is negative, waiting for room if they are full
+    void push(Message* message, const int& stream);
+    
+    // Whether all the streams are done with their queues,
+    // called with the mutex held
+    bool drained() const;
+    
+    // Moves the quality level depending on how full the queues are,
+    // called with the mutex held
+    void adapt();
+    void setQuality(const int& quality);
+
+    // Sender thread loop of a stream
+    void run(const int& stream);
+
+    std::vector<Stream*> mStreams;
+    size_t mCapacity;
+
+    // Messages in all the queues, counted once per stream, and recycled messages
+    size_t mDepth;
+    std::vector<Message*> mFree;
+    
+    // Last message number
+    int mSequence;
+    bool mQuit;
+    
+    // Degradation level, the AOV kept at QUALITY_PRIMARY and the number
+    // of messages queued since the level last changed
+    int mQuality, mPrimaryAov, mSinceChange;
+    std::vector<std::string> mEvents;
+    
+    // Pixels sent, and time spent sending them
+    double mSentBytes, mSendTime;
+    
+    // Queue statistics
+    size_t mPeakDepth;
+    int mStalls;
+    double mStallTime;
+    std::string mError;
+
+    // Threading stuff
+    boost::mutex mMutex;
+    boost::condition_variable mNotEmpty, mNotFull, mDrained;
+};
+
+#endif // ATON_SENDER_H_
@@ -6,18 +6,130 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "Server.h"
 #include "Client.h"
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 using namespace boost::asio;
+using namespace boost::posix_time;
+
+// Size of the chunks pulled from the socket at once
+static const size_t receiveBufferSize = 1 << 18;
+
+// Receives the Uring keeps in flight per connection and their size, a
+// small pool stays in cache
+static const size_t uringBufferCount = 4;
+static const size_t uringBufferSize = 1 << 16;
+
+// Size of the shared memory Ring for local Clients
+static const size_t ringSize = 1 << 25;
+
+// Limits of the AOV dictionary sent at image open
+static const int maxAovCount = 1024;
+static const int maxAovNameSize = 1024;
+
+// Coarsest subsampling a Client may send
+static const int maxSubsample = 8;
+
+// Most streams a render may open
+static const int maxStreams = 64;
+
+// Whether a bucket lies inside its image, and its samples for spp
+// channels can be counted in an int
+static bool isBucketValid(const Data& d, const int& spp)
+{
+    if (d.bucket_size_x() <= 0 || d.bucket_size_x() > d.xres() ||
+        d.bucket_size_y() <= 0 || d.bucket_size_y() > d.yres() ||
+        d.bucket_xo() < 0 || d.bucket_xo() > d.xres() - d.bucket_size_x() ||
+        d.bucket_yo() < 0 || d.bucket_yo() > d.yres() - d.bucket_size_y() ||
+        spp <= 0)
+        return false;
+    
+    const size_t samples = static_cast<size_t>(d.bucket_size_x()) * d.bucket_size_y();
+    return samples <= static_cast<size_t>(INT_MAX) / spp;
+}
+
+// Plane of a bucket, keyed the way the Client keeps its hashes
+static long long planeKey(const int& aov, const int& xo, const int& yo)
+{
+    return (static_cast<long long>(aov) << 42) |
+           (static_cast<long long>(xo & 0x1fffff) << 21) |
+           (yo & 0x1fffff);
+}
+
+// Capabilities this Server can handle
+#ifdef _WIN32
+static const int supportedCapabilities = CAP_COMPRESSION | CAP_HALF | CAP_PREVIEW |
+                                         CAP_UNCHANGED | CAP_SUBSAMPLE | CAP_STREAMS |
+                                         CAP_REGION | CAP_TARGET | CAP_VERSION | CAP_BATCH |
+                                         CAP_STRIPS;
+#else
+static const int supportedCapabilities = CAP_COMPRESSION | CAP_HALF | CAP_PREVIEW |
+                                         CAP_UNCHANGED | CAP_SUBSAMPLE | CAP_STREAMS |
+                                         CAP_REGION | CAP_TARGET | CAP_VERSION | CAP_BATCH |
+                                         CAP_STRIPS | CAP_SHM;
+#endif
+
+Connection::Connection(Server* server,
+                       io_service& ioService): mServer(server),
+                                               mCapabilities(0),
+                                               mVersion(0),
+                                               mGreeted(false),
+                                               mLegacy(false),
+                                               mSession(0),
+                                               mStream(0),
+                                               mStreams(1),
+                                               mSequence(0),
+                                               mImageId(0),
+                                               mGeneration(0),
+                                               mFrame(0),
+                                               mConsumed(0),
+                                               mMessageEnd(0),
+                                               mScanned(0),
+                                               mReplacedAt(0),
+                                               mSkipped(0),
+                                               mSkippedTime(0),
+                                               mAllocations(0),
+                                               mChunk(NULL),
+                                               mChunkPos(0),
+                                               mChunkEnd(0),
+                                               mUringChecked(false),
+                                               mBuffer(receiveBufferSize),
+                                               mBufferPos(0),
+                                               mBufferEnd(0),
+                                               mSocket(ioService)
+{
+}
+
+Connection::~Connection()
+{
+    mRing.close();
+    mUring.close();
+    mSocket.close();
+}
+
+void Connection::shutdown()
+{
+    boost::system::error_code error;
+    if (mSocket.is_open())
+        mSocket.shutdown(ip::tcp::socket::shutdown_both, error);
+}
 
 Server::Server(): mPort(0),
-                  mSocket(mIoService),
+                  mSessionCount(0),
+                  mImageCount(0),
+                  mQuitting(false),
                   mAcceptor(mIoService)
 {
 }
 
 Server::Server(int port): mPort(0),
-                          mSocket(mIoService),
+                          mSessionCount(0),
+                          mImageCount(0),
+                          mQuitting(false),
                           mAcceptor(mIoService)
 {
     connect(port);
@@ -27,6 +139,10 @@ Server::~Server()
 {
     if (mAcceptor.is_open())
         mAcceptor.close();
+    
+    std::set<Connection*>::iterator it;
+    for (it = mConnections.begin(); it != mConnections.end(); ++it)
+        delete *it;
 }
 
 void Server::connect(int port, bool search)
@@ -74,104 +190,1174 @@ void Server::connect(int port, bool search)
 
 void Server::quit()
 {
+    // Wake up the listen() calls blocked on idle persistent connections
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        mQuitting = true;
+    }
+    shutdown();
+
     std::string hostname("localhost");
     Client client(hostname, mPort);
     client.quit();
 }
 
-void Server::accept()
+void Server::shutdown()
 {
-    if (mSocket.is_open())
-        mSocket.close();
-    mAcceptor.accept(mSocket);
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    std::set<Connection*>::iterator it;
+    for (it = mConnections.begin(); it != mConnections.end(); ++it)
+        (*it)->shutdown();
+}
+
+bool Server::isQuitting()
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    return mQuitting;
+}
+
+Connection* Server::accept()
+{
+    Connection* connection = new Connection(this, mIoService);
+    try
+    {
+        mAcceptor.accept(connection->mSocket);
+    }
+    catch (...)
+    {
+        delete connection;
+        throw;
+    }
+    
+    // Streams of a render replace it in the handshake
+    connection->mSession = newSession();
+    
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    mConnections.insert(connection);
+    return connection;
+}
+
+void Server::release(Connection* connection)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        mConnections.erase(connection);
+        
+        // Forget the session once its last stream is gone
+        bool last = true;
+        std::set<Connection*>::iterator it;
+        for (it = mConnections.begin(); it != mConnections.end() && last; ++it)
+            last = (*it)->mSession != connection->mSession;
+        if (last)
+            mImages.erase(connection->mSession);
+    }
+    delete connection;
+}
+
+long long Server::newSession()
+{
+    // Negative, Clients pick positive ones for their streams
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    return -(++mSessionCount);
+}
+
+int Server::newImage(const long long& session,
+                     const int& sequence,
+                     const int& generation,
+                     const float& frame)
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    ImageOpen& image = mImages[session];
+    if (image.sequence != sequence || image.id == 0)
+    {
+        image.sequence = sequence;
+        image.id = ++mImageCount;
+        image.generation = generation;
+        image.frame = frame;
+    }
+    return image.id;
+}
+
+int Server::generation(const long long& session, const float& frame)
+{
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    std::map<long long, ImageOpen>::const_iterator it = mImages.find(session);
+    if (it == mImages.end() || it->second.frame != frame)
+        return 0;
+    return it->second.generation;
+}
+
+void Connection::receive(void* dst, size_t size)
+{
+    char* out = static_cast<char*>(dst);
+    mConsumed += size;
+    
+    if (mRing.isOpen())
+    {
+        receiveFromRing(out, size);
+        return;
+    }
+    
+    // Serve what we already have in the buffer
+    const size_t buffered = std::min(mBufferEnd - mBufferPos, size);
+    memcpy(out, &mBuffer[mBufferPos], buffered);
+    mBufferPos += buffered;
+    out += buffered;
+    size -= buffered;
+    
+    if (size == 0)
+        return;
+    
+    if (mUring.isOpen())
+    {
+        receiveFromUring(out, size);
+        if (size == 0)
+            return;
+    }
+    
+    // Big payloads are read straight into their destination
+    if (size >= mBuffer.size())
+    {
+        read(mSocket, buffer(out, size));
+        return;
+    }
+    
+    // Refill with as much as the socket has, but at least what we need
+    mBufferEnd = read(mSocket, buffer(&mBuffer[0], mBuffer.size()), transfer_at_least(size));
+    memcpy(out, &mBuffer[0], size);
+    mBufferPos = size;
+}
+
+const char* Connection::receiveView(char* dst, const size_t& size)
+{
+    // Bytes that don't wrap around are used where they are in the Ring
+    if (mRing.isOpen() && !mRing.wraps(size))
+    {
+        mConsumed += size;
+        const char* view;
+        for (int idle = 1; (view = mRing.view(size)) == NULL; ++idle)
+            waitForRing(idle);
+        
+        if (reinterpret_cast<size_t>(view) % sizeof(float) != 0)
+        {
+            memcpy(dst, view, size);
+            return dst;
+        }
+        return view;
+    }
+    
+    // Big payloads don't fit the buffer
+    if (mRing.isOpen() || size > mBuffer.size())
+    {
+        receive(dst, size);
+        return dst;
+    }
+    
+    if (mUring.isOpen())
+    {
+        // Bytes split across chunks, or left over from before the Uring
+        // started, get copied
+        if (mBufferPos != mBufferEnd ||
+            (mChunkPos == mChunkEnd && !nextChunk()) ||
+            mChunkEnd - mChunkPos < size)
+        {
+            receive(dst, size);
+            return dst;
+        }
+        
+        const char* view = mChunk + mChunkPos;
+        mChunkPos += size;
+        mConsumed += size;
+        if (reinterpret_cast<size_t>(view) % sizeof(float) != 0)
+        {
+            memcpy(dst, view, size);
+            return dst;
+        }
+        return view;
+    }
+    
+    // Move what we have to the front and top it up
+    size_t buffered = mBufferEnd - mBufferPos;
+    if (buffered < size)
+    {
+        memmove(&mBuffer[0], &mBuffer[mBufferPos], buffered);
+        buffered += read(mSocket, buffer(&mBuffer[buffered], mBuffer.size() - buffered),
+                         transfer_at_least(size - buffered));
+        mBufferPos = 0;
+        mBufferEnd = buffered;
+    }
+    
+    const char* view = &mBuffer[mBufferPos];
+    mBufferPos += size;
+    mConsumed += size;
+    
+    // Pixels have to be float aligned, payloads of odd sizes shift them
+    if (reinterpret_cast<size_t>(view) % sizeof(float) != 0)
+    {
+        memcpy(dst, view, size);
+        return dst;
+    }
+    return view;
+}
+
+void Connection::skip(size_t size)
+{
+    // Left where they are whenever they fit the receive buffer
+    while (size > 0)
+    {
+        const size_t n = std::min(size, mBuffer.size());
+        resizeBuffer(mPayload, n, mAllocations);
+        receiveView(&mPayload[0], n);
+        size -= n;
+    }
+}
+
+bool Connection::peek(const size_t& offset, void* dst, const size_t& size)
+{
+    if (mRing.isOpen())
+        return mRing.peek(offset, dst, size);
+    
+    // Only what is left of the current chunk, the kernel has the rest
+    if (mUring.isOpen())
+    {
+        if (mBufferPos != mBufferEnd || mChunkEnd - mChunkPos < offset + size)
+            return false;
+        memcpy(dst, mChunk + mChunkPos + offset, size);
+        return true;
+    }
+    
+    size_t buffered = mBufferEnd - mBufferPos;
+    if (buffered < offset + size)
+    {
+        if (offset + size > mBuffer.size())
+            return false;
+        
+        // Make room at the end, and take whatever the socket has
+        if (mBufferPos + offset + size > mBuffer.size())
+        {
+            memmove(&mBuffer[0], &mBuffer[mBufferPos], buffered);
+            mBufferPos = 0;
+            mBufferEnd = buffered;
+        }
+        
+        boost::system::error_code error;
+        const size_t available = mSocket.available(error);
+        if (error || available == 0)
+            return false;
+        
+        mBufferEnd += mSocket.read_some(buffer(&mBuffer[mBufferEnd],
+                                               std::min(available, mBuffer.size() - mBufferEnd)), error);
+        buffered = mBufferEnd - mBufferPos;
+        if (error || buffered < offset + size)
+            return false;
+    }
+    
+    memcpy(dst, &mBuffer[mBufferPos + offset], size);
+    return true;
+}
+
+bool Connection::isReplaced(const BucketHeader& header)
+{
+    // Still before an open we found earlier
+    if (mReplacedAt > mConsumed)
+        return true;
+    
+    // Another stream got to a newer open of the frame first
+    if (mStreams > 1 && mServer->generation(mSession, mFrame) > header.imageId)
+        return true;
+    
+    // Look through the messages we already have after this one, from
+    // where we stopped last time. The planes of this bucket come first.
+    const bool framed = mVersion >= 1;
+    size_t offset = 0;
+    if (mScanned > mConsumed)
+        offset = static_cast<size_t>(mScanned - mConsumed);
+    else if (framed)
+        offset = static_cast<size_t>(mMessageEnd - mConsumed);
+    else
+    {
+        for (int i = 0; i < header.planeCount; ++i)
+        {
+            PlaneHeader plane;
+            if (!peek(offset, &plane, sizeof(PlaneHeader)) || plane.payloadSize < 0)
+                return false;
+            offset += sizeof(PlaneHeader) + plane.payloadSize;
+        }
+    }
+    
+    while (true)
+    {
+        int prefix[2];
+        const size_t prefixSize = framed ? 2 * sizeof(int) : sizeof(int);
+        if (!peek(offset, prefix, prefixSize) || (framed && prefix[1] < 0))
+            break;
+        
+        const int& key = prefix[0];
+        const size_t body = offset + prefixSize;
+        if (key == 0)
+        {
+            // Generation, sequence, resolution, region area and version
+            // come before the frame
+            const size_t frameOffset = 4 * sizeof(int) + sizeof(long long) + sizeof(int);
+            int generation;
+            float frame;
+            if (peek(body, &generation, sizeof(int)) &&
+                peek(body + frameOffset, &frame, sizeof(float)) &&
+                frame == mFrame && generation > header.imageId)
+            {
+                mReplacedAt = mScanned = mConsumed + offset;
+                return true;
+            }
+            
+            // Opens of other frames end the search until we get there
+            break;
+        }
+        
+        // Messages say how long they are, and batches hold messages
+        if (framed)
+        {
+            offset = key == 4 ? body : body + prefix[1];
+            continue;
+        }
+        
+        if (key == 1)
+        {
+            BucketHeader next;
+            if (!peek(offset, &next, sizeof(BucketHeader)) ||
+                next.planeCount < 0 || next.planeCount > maxAovCount)
+                break;
+            
+            // Only whole buckets, we come back for the rest
+            size_t end = offset + sizeof(BucketHeader);
+            int i = 0;
+            for (; i < next.planeCount; ++i)
+            {
+                PlaneHeader plane;
+                if (!peek(end, &plane, sizeof(PlaneHeader)) || plane.payloadSize < 0)
+                    break;
+                end += sizeof(PlaneHeader) + plane.payloadSize;
+            }
+            if (i < next.planeCount)
+                break;
+            offset = end;
+        }
+        else if (key == 2)
+        {
+            const size_t closeSize = 3 * sizeof(int);
+            char close[closeSize];
+            if (!peek(offset, close, closeSize))
+                break;
+            offset += closeSize;
+        }
+        else
+            break;
+    }
+    
+    mScanned = mConsumed + offset;
+    return false;
+}
+
+void Connection::receiveSkipped(const BucketHeader& header, const int& strip_rows)
+{
+    resizeBuffer(mRestored, header.planeCount, mAllocations);
+    
+    const int height = header.bucket_size_y;
+    for (int row = 0; row == 0 || row < height; row += strip_rows)
+    {
+        for (int i = 0; i < header.planeCount; ++i)
+        {
+            PlaneHeader plane_header;
+            receive(&plane_header, sizeof(PlaneHeader));
+            if (plane_header.aov < 0 || plane_header.aov >= static_cast<int>(mAovs.size()) ||
+                plane_header.payloadSize < 0)
+                throw std::runtime_error("Unexpected pixels size!");
+            
+            // Unchanged pixels are the ones we have, or kept already
+            const bool unchanged = plane_header.codec == Codec::Unchanged;
+            if (row == 0)
+            {
+                mRestored[i] = NULL;
+                if (!unchanged)
+                {
+                    SkippedPlane& skipped = mSkippedPlanes[planeKey(plane_header.aov,
+                                                                    header.bucket_xo,
+                                                                    header.bucket_yo)];
+                    skipped.strip_rows = strip_rows;
+                    skipped.headers.clear();
+                    skipped.payload.clear();
+                    mRestored[i] = &skipped;
+                }
+            }
+            else if (unchanged != (mRestored[i] == NULL) ||
+                     (!unchanged && mRestored[i]->headers[0].aov != plane_header.aov))
+                throw std::runtime_error("Unexpected strip!");
+            
+            if (unchanged)
+            {
+                if (plane_header.payloadSize != 0)
+                    throw std::runtime_error("Unexpected unchanged pixels!");
+                continue;
+            }
+            
+            SkippedPlane& skipped = *mRestored[i];
+            skipped.headers.push_back(plane_header);
+            const size_t offset = skipped.payload.size();
+            resizeBuffer(skipped.payload, offset + plane_header.payloadSize, mAllocations);
+            if (plane_header.payloadSize > 0)
+                receive(&skipped.payload[offset], plane_header.payloadSize);
+        }
+    }
+}
+
+void Connection::receiveFromRing(char* dst, size_t size)
+{
+    int idle = 0;
+    while (size > 0)
+    {
+        const size_t n = mRing.read(dst, size);
+        dst += n;
+        size -= n;
+        
+        if (n > 0)
+            idle = 0;
+        else
+            waitForRing(++idle);
+    }
+}
+
+void Connection::waitForRing(const int& idle)
+{
+    // Client went quiet, make sure it is still there while we wait
+    if (idle % 64 == 0 && !isClientAlive())
+        throw std::runtime_error("Client disconnected!");
+    mRing.waitToRead(idle);
+}
+
+void Connection::receiveFromUring(char*& dst, size_t& size)
+{
+    while (size > 0)
+    {
+        if (mChunkPos == mChunkEnd && !nextChunk())
+            return;
+        
+        const size_t n = std::min(mChunkEnd - mChunkPos, size);
+        memcpy(dst, mChunk + mChunkPos, n);
+        mChunkPos += n;
+        dst += n;
+        size -= n;
+    }
+}
+
+bool Connection::nextChunk()
+{
+    const long n = mUring.next(mChunk);
+    if (n > 0)
+    {
+        mChunkPos = 0;
+        mChunkEnd = static_cast<size_t>(n);
+        return true;
+    }
+    
+    // Kernels without multishot receives only tell us now
+    if (n == -EINVAL && mUring.received() == 0)
+    {
+        mUring.close();
+        mChunkPos = mChunkEnd = 0;
+        return false;
+    }
+    throw std::runtime_error("Client disconnected!");
+}
+
+void Connection::receiveSequence(Data& d)
+{
+    receive(&d.mSequence, sizeof(int));
+    if (d.mSequence <= mSequence)
+        throw std::runtime_error("Unexpected sequence number!");
+    mSequence = d.mSequence;
 }
 
-Data Server::listen()
+bool Connection::isClientAlive()
+{
+    // Client doesn't write to the socket once it uses the Ring,
+    // so anything readable means it went away
+    char c;
+    boost::system::error_code error;
+    mSocket.non_blocking(true);
+    mSocket.read_some(buffer(&c, 1), error);
+    mSocket.non_blocking(false);
+    
+    return error == boost::asio::error::would_block;
+}
+
+Data Connection::listen(BucketSink* sink)
 {
     Data d;
+    listen(d, sink);
+    return d;
+}
+
+void Connection::listen(Data& d, BucketSink* sink)
+{
+    while (!receiveMessage(d, sink));
+}
+
+bool Connection::receiveMessage(Data& d, BucketSink* sink)
+{
+    d.clear();
 
     // Read the key from the incoming data
     try
     {
-        read(mSocket, buffer(reinterpret_cast<char*>(&d.mType), sizeof(int)));
+        receive(&d.mType, sizeof(int));
+        
+        // Remote Clients are done with the handshake by the time they send
+        // anything else, from then on ATON_URING=1 has the socket read by
+        // the Uring, if the kernel can
+        if (!mUringChecked && d.mType != 3 && !mRing.isOpen())
+        {
+            mUringChecked = true;
+            const char* uring = getenv("ATON_URING");
+            if (uring != NULL && strcmp(uring, "1") == 0)
+                mUring.open(mSocket.native_handle(), uringBufferCount, uringBufferSize);
+        }
+        d.mSession = mSession;
+        
+        // Drivers from before the handshake open their image right away
+        if (!mGreeted)
+        {
+            mGreeted = true;
+            mLegacy = d.mType == 0;
+        }
+        if (mLegacy)
+        {
+            receiveLegacy(d, sink);
+            return true;
+        }
+        
+        // From version 1 on the size of the message comes next, what we
+        // don't know we read past
+        const bool framed = mVersion >= 1;
+        if (framed)
+        {
+            int length;
+            receive(&length, sizeof(int));
+            if (length < 0)
+                throw std::runtime_error("Unexpected message size!");
+            mMessageEnd = mConsumed + length;
+            
+            if (d.mType == 4 && (mCapabilities & CAP_BATCH))
+                return false;
+            if ((d.mType < 0 || d.mType > 2) && !(d.mType == 5 && (mCapabilities & CAP_STRIPS)))
+            {
+                skip(length);
+                return false;
+            }
+        }
 
         switch(d.mType)
         {
             case 0: // Open image
             {
-                // Send back an image id
-                int image_id = 1;
-                write(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)));
+                // Client numbers the generations of its images
+                receive(&mGeneration, sizeof(int));
+                receiveSequence(d);
                 
                 // Read data from the buffer
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mXres), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mYres), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mRArea), sizeof(long long)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mVersion), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mCurrentFrame), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mCamFov), sizeof(float)));
+                receive(&d.mXres, sizeof(int));
+                receive(&d.mYres, sizeof(int));
+                receive(&d.mRArea, sizeof(long long));
+                receive(&d.mVersion, sizeof(int));
+                receive(&d.mCurrentFrame, sizeof(float));
+                mFrame = d.mCurrentFrame;
+                
+                // How long the replaced generation got to render
+                d.mTime = mSkippedTime;
+                mSkippedTime = 0;
+                
+                // Image id is numbered by the Server, across all the renders
+                mImageId = mServer->newImage(mSession, d.mSequence, mGeneration, mFrame);
+                d.mImageId = mImageId;
+                receive(&d.mCamFov, sizeof(float));
                 
                 const int camMatrixSize = 16;
-                d.mCamMatrixStore.resize(camMatrixSize);
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mCamMatrixStore[0]), sizeof(float)*camMatrixSize));
+                resizeBuffer(d.mCamMatrixStore, camMatrixSize, mAllocations);
+                receive(&d.mCamMatrixStore[0], sizeof(float)*camMatrixSize);
+                
+                // Region the render covers, all of the image unless told
+                if (mCapabilities & CAP_REGION)
+                {
+                    receive(&d.mBucket_xo, sizeof(int));
+                    receive(&d.mBucket_yo, sizeof(int));
+                    receive(&d.mBucket_size_x, sizeof(int));
+                    receive(&d.mBucket_size_y, sizeof(int));
+                    if (d.mBucket_size_x < 0 || d.mBucket_size_y < 0)
+                        throw std::runtime_error("Unexpected region!");
+                }
+                if (d.mBucket_size_x == 0 || d.mBucket_size_y == 0)
+                {
+                    d.mBucket_xo = d.mBucket_yo = 0;
+                    d.mBucket_size_x = d.mXres;
+                    d.mBucket_size_y = d.mYres;
+                }
+                
+                // Node the render goes to
+                if (mCapabilities & CAP_TARGET)
+                {
+                    int target_size;
+                    receive(&target_size, sizeof(int));
+                    if (target_size < 0 || target_size > maxAovNameSize)
+                        throw std::runtime_error("Unexpected target!");
+                    
+                    d.mTarget.resize(target_size);
+                    if (target_size > 0)
+                        receive(&d.mTarget[0], target_size);
+                }
+                
+                // AOV dictionary, the buckets of this image refer to it
+                int aov_count;
+                receive(&aov_count, sizeof(int));
+                if (aov_count < 0 || aov_count > maxAovCount)
+                    throw std::runtime_error("Unexpected AOV count!");
+                
+                resizeBuffer(d.mAovs, aov_count, mAllocations);
+                for (int i = 0; i < aov_count; ++i)
+                {
+                    Aov& aov = d.mAovs[i];
+                    int name_size;
+                    receive(&aov.spp, sizeof(int));
+                    receive(&name_size, sizeof(int));
+                    if (aov.spp <= 0 || name_size <= 0 || name_size > maxAovNameSize)
+                        throw std::runtime_error("Unexpected AOV!");
+                    
+                    // Up to the first null, the last character being one
+                    aov.name.resize(name_size);
+                    receive(&aov.name[0], name_size);
+                    aov.name.resize(std::min(aov.name.find('\0'), static_cast<size_t>(name_size - 1)));
+                }
+                mAovs = d.mAovs;
                 break;
             }
             case 1: // Image data
+            case 5: // Image data in row strips
             {
-                // Receive image id
-                int image_id;
-                read(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)) );
+                const bool striped = d.mType == 5;
+                if (striped && !(mCapabilities & CAP_STRIPS))
+                    throw std::runtime_error("Unexpected strips!");
+                d.mType = 1;
+                
+                // Rest of the header after the key we already have
+                BucketHeader header;
+                const size_t keySize = sizeof(header.key);
+                receive(reinterpret_cast<char*>(&header) + keySize,
+                        sizeof(BucketHeader) - keySize);
 
-                // Read data from the buffer
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mXres), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mYres), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mBucket_xo), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mBucket_yo), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mBucket_size_x), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mBucket_size_y), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mRArea), sizeof(long long)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mVersion), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mCurrentFrame), sizeof(float)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mSpp), sizeof(int)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mRam), sizeof(long long)));
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mTime), sizeof(int)));
-
-                // Get aov name's size
-                size_t aov_size;
-                read(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
-
-                // Get aov name
-                char* aov_name = new char[aov_size];
-                read(mSocket, buffer(aov_name, aov_size));
-                d.mAovName = aov_name;
-
-                // Get pixels
-                const int num_samples = d.bucket_size_x() * d.bucket_size_y() * d.spp();
-                d.mPixelStore.resize(num_samples);
-                read(mSocket, buffer(reinterpret_cast<char*>(&d.mPixelStore[0]), sizeof(float)*num_samples));
+                if (header.sequence <= mSequence)
+                    throw std::runtime_error("Unexpected sequence number!");
+                mSequence = d.mSequence = header.sequence;
+                d.mImageId = mImageId;
+                
+                d.mXres = header.xres;
+                d.mYres = header.yres;
+                d.mBucket_xo = header.bucket_xo;
+                d.mBucket_yo = header.bucket_yo;
+                d.mBucket_size_x = header.bucket_size_x;
+                d.mBucket_size_y = header.bucket_size_y;
+                d.mRArea = header.rArea;
+                d.mVersion = header.version;
+                d.mCurrentFrame = header.currentFrame;
+                d.mRam = header.ram;
+                d.mTime = header.time;
+                d.mQuality = header.quality;
+                
+                // Every plane has to fit, whatever its AOV
+                int spp = 1;
+                for (size_t i = 0; i < mAovs.size(); ++i)
+                    spp = std::max(spp, mAovs[i].spp);
+                if (!isBucketValid(d, spp))
+                    throw std::runtime_error("Unexpected bucket!");
+                
+                // Subsampled planes are expanded back to the bucket size
+                const int step = header.subsample;
+                if (step < 1 || step > maxSubsample || (step > 1 && !(mCapabilities & CAP_SUBSAMPLE)))
+                    throw std::runtime_error("Unexpected subsampling!");
+                
+                if (header.planeCount < 0 || header.planeCount > static_cast<int>(mAovs.size()))
+                    throw std::runtime_error("Unexpected plane count!");
+                
+                // Whole bucket in one strip unless told otherwise
+                int strip_rows = std::max(d.mBucket_size_y, 1);
+                if (striped)
+                {
+                    receive(&strip_rows, sizeof(int));
+                    if (strip_rows < 1 || strip_rows % step != 0)
+                        throw std::runtime_error("Unexpected strip size!");
+                }
+                
+                // Read past the pixels of a replaced generation
+                if (isReplaced(header))
+                {
+                    // Client may leave out these pixels next time
+                    const int planeCount = framed ? 0 : header.planeCount;
+                    if (mCapabilities & CAP_UNCHANGED)
+                        receiveSkipped(header, strip_rows);
+                    else for (int i = 0; i < planeCount; ++i)
+                    {
+                        PlaneHeader plane_header;
+                        receive(&plane_header, sizeof(PlaneHeader));
+                        if (plane_header.payloadSize < 0)
+                            throw std::runtime_error("Unexpected pixels size!");
+                        skip(plane_header.payloadSize);
+                    }
+                    if (framed)
+                        skip(static_cast<size_t>(mMessageEnd - mConsumed));
+                    ++mSkipped;
+                    mSkippedTime = header.time;
+                    return false;
+                }
+
+                // Read the plane headers and pixels into one store, or
+                // hand them to the sink as they come
+                const int width = d.mBucket_size_x;
+                const int height = d.mBucket_size_y;
+                const int bucket_yo = d.mBucket_yo;
+                resizeBuffer(d.mPlanes, header.planeCount, mAllocations);
+                resizeBuffer(mOffsets, header.planeCount, mAllocations);
+                resizeBuffer(mRestored, header.planeCount, mAllocations);
+                
+                size_t size = 0;
+                for (int row = 0; row == 0 || row < height; row += strip_rows)
+                {
+                    // The sink gets every strip as a bucket of its own,
+                    // and can write it before the next one arrives
+                    const int rows = std::min(strip_rows, height - row);
+                    d.mBucket_yo = bucket_yo + row;
+                    d.mBucket_size_y = rows;
+                    
+                    const int num_pixels = width * rows;
+                    const int num_sent = Codec::subsampledSize(width, step) *
+                                         Codec::subsampledSize(rows, step);
+                    
+                    for (int i = 0; i < header.planeCount; ++i)
+                    {
+                        PlaneHeader plane_header;
+                        receive(&plane_header, sizeof(PlaneHeader));
+                        if (plane_header.aov < 0 || plane_header.aov >= static_cast<int>(mAovs.size()))
+                            throw std::runtime_error("Unknown AOV!");
+                        
+                        const Aov& aov = mAovs[plane_header.aov];
+                        Plane& plane = d.mPlanes[i];
+                        const bool unchanged = plane_header.codec == Codec::Unchanged;
+                        if (row == 0)
+                        {
+                            plane.aov = plane_header.aov;
+                            plane.spp = aov.spp;
+                            plane.precision = plane_header.precision;
+                            plane.name = aov.name.c_str();
+                            plane.data = NULL;
+                            mOffsets[i] = -1;
+                            mRestored[i] = NULL;
+                        }
+                        else if (plane.aov != plane_header.aov ||
+                                 unchanged != (mOffsets[i] < 0 || mRestored[i] != NULL))
+                            throw std::runtime_error("Unexpected strip!");
+                        
+                        // Client left out pixels we already have, unless
+                        // they were in a bucket we read past
+                        const long long key = planeKey(plane.aov, header.bucket_xo, bucket_yo);
+                        if (unchanged)
+                        {
+                            if (!(mCapabilities & CAP_UNCHANGED) || plane_header.payloadSize != 0)
+                                throw std::runtime_error("Unexpected unchanged pixels!");
+                            if (row == 0 && !mSkippedPlanes.empty())
+                            {
+                                std::map<long long, SkippedPlane>::iterator it = mSkippedPlanes.find(key);
+                                if (it != mSkippedPlanes.end())
+                                    mRestored[i] = &it->second;
+                            }
+                            if (mRestored[i] == NULL)
+                            {
+                                mStats.addUnchanged(sizeof(float) * num_pixels * aov.spp);
+                                if (sink != NULL)
+                                    sink->write(d, plane, NULL);
+                                continue;
+                            }
+                        }
+                        else if (row == 0 && !mSkippedPlanes.empty())
+                            mSkippedPlanes.erase(key);
+                        
+                        // Strips land in the rows of the store they cover
+                        float* store = NULL;
+                        if (row == 0)
+                        {
+                            mOffsets[i] = size;
+                            if (sink == NULL)
+                            {
+                                size += width * height * aov.spp;
+                                resizeBuffer(d.mPixelStore, size, mAllocations);
+                            }
+                        }
+                        if (sink == NULL)
+                            store = &d.mPixelStore[mOffsets[i] + width * row * aov.spp];
+                        else
+                            store = sink->buffer(d, plane, num_pixels * aov.spp);
+                        
+                        // Skipped strips were sent with the same rows
+                        const float* pixels;
+                        float* target = step == 1 ? store : NULL;
+                        const int num_samples = (step == 1 ? num_pixels : num_sent) * aov.spp;
+                        if (mRestored[i] != NULL)
+                        {
+                            const SkippedPlane& skipped = *mRestored[i];
+                            const size_t strip = row / strip_rows;
+                            if (skipped.strip_rows != strip_rows || strip >= skipped.headers.size())
+                                throw std::runtime_error("Unexpected unchanged pixels!");
+                            
+                            size_t offset = 0;
+                            for (size_t j = 0; j < strip; ++j)
+                                offset += skipped.headers[j].payloadSize;
+                            if (target == NULL)
+                            {
+                                resizeBuffer(mPixels, num_samples, mAllocations);
+                                target = &mPixels[0];
+                            }
+                            pixels = decodePlane(skipped.headers[strip],
+                                                 skipped.payload.empty() ? NULL : &skipped.payload[offset],
+                                                 target, num_samples, aov.spp);
+                        }
+                        else
+                            pixels = receivePlane(plane_header, target, num_samples, aov.spp);
+                        
+                        if (step > 1)
+                        {
+                            const float* sent = pixels;
+                            if (store == NULL)
+                            {
+                                resizeBuffer(mExpanded, num_pixels * aov.spp, mAllocations);
+                                store = &mExpanded[0];
+                            }
+                            Codec::expand(sent, width, rows, aov.spp, step, store);
+                            pixels = store;
+                        }
+                        
+                        if (sink != NULL)
+                            sink->write(d, plane, pixels);
+                    }
+                }
+                d.mBucket_yo = bucket_yo;
+                d.mBucket_size_y = height;
+                
+                // Restored pixels are written now, like sent ones
+                for (int i = 0; i < header.planeCount; ++i)
+                    if (mRestored[i] != NULL)
+                        mSkippedPlanes.erase(planeKey(d.mPlanes[i].aov, header.bucket_xo, bucket_yo));
+                
+                // Store is done growing
+                if (sink == NULL)
+                    for (int i = 0; i < header.planeCount; ++i)
+                        if (mOffsets[i] >= 0)
+                            d.mPlanes[i].data = &d.mPixelStore[mOffsets[i]];
                 break;
             }
             case 2: // Close image
             {
+                // Keep the connection, the Client reuses it for the next image
                 int image_id;
-                read(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)));
-                mSocket.close();
+                receive(&image_id, sizeof(int));
+                receiveSequence(d);
+                d.mImageId = mImageId;
+                break;
+            }
+            case 3: // Handshake
+            {
+                int capabilities;
+                receive(&capabilities, sizeof(int));
+                mCapabilities = capabilities & supportedCapabilities;
+                
+                // Which stream of which render this is
+                if (capabilities & CAP_STREAMS)
+                {
+                    receive(&mSession, sizeof(long long));
+                    receive(&mStream, sizeof(int));
+                    receive(&mStreams, sizeof(int));
+                    if (mSession < 0 || mStreams < 1 || mStreams > maxStreams || mStream < 0 || mStream >= mStreams)
+                        throw std::runtime_error("Unexpected stream!");
+                    d.mSession = mSession;
+                }
+                
+                // Local Client, offer it a Ring
+                if ((mCapabilities & CAP_SHM) && !mRing.create(ringSize))
+                    mCapabilities &= ~CAP_SHM;
+                
+                write(mSocket, buffer(reinterpret_cast<char*>(&mCapabilities), sizeof(int)));
+                
+                // Client picks the version, no newer than ours
+                mVersion = 0;
+                if (mCapabilities & CAP_VERSION)
+                {
+                    int version = protocolVersion;
+                    write(mSocket, buffer(reinterpret_cast<char*>(&version), sizeof(int)));
+                    read(mSocket, buffer(reinterpret_cast<char*>(&version), sizeof(int)));
+                    if (version < 0 || version > protocolVersion)
+                        throw std::runtime_error("Unexpected protocol version!");
+                    mVersion = version;
+                }
+                if (mVersion < 1)
+                    mCapabilities &= ~(CAP_BATCH | CAP_STRIPS);
+                
+                if (mCapabilities & CAP_SHM)
+                {
+                    const std::string& name = mRing.name();
+                    int name_size = static_cast<int>(name.size());
+                    write(mSocket, buffer(reinterpret_cast<char*>(&name_size), sizeof(int)));
+                    write(mSocket, buffer(name));
+                    
+                    // Client has it mapped by now, if it could. The answer
+                    // still comes through the socket.
+                    int use_ring;
+                    read(mSocket, buffer(reinterpret_cast<char*>(&use_ring), sizeof(int)));
+                    mRing.unlink();
+                    if (!use_ring)
+                    {
+                        mRing.close();
+                        mCapabilities &= ~CAP_SHM;
+                    }
+                }
                 break;
             }
             case 9: // quit
             {
+                mUring.close();
                 mSocket.close();
                 
                 // This fixes all nuke destructor issues on windows
-                mAcceptor.close();
+                mServer->mAcceptor.close();
                 break;
             }
         }
+        
+        // Fields a newer Client added at the end
+        if (framed)
+        {
+            if (mConsumed > mMessageEnd)
+                throw std::runtime_error("Unexpected message size!");
+            skip(static_cast<size_t>(mMessageEnd - mConsumed));
+        }
     }
     catch( ... )
     {
+        mUring.close();
         mSocket.close();
         throw std::runtime_error("Could not read from socket!");
     }
-    return d;
+    return true;
+}
+
+void Connection::receiveLegacy(Data& d, BucketSink* sink)
+{
+    switch(d.mType)
+    {
+        case 0: // Open image
+        {
+            // Client waits for an image id before it goes on, and only
+            // ever sends it back
+            int image_id = 1;
+            write(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)));
+            
+            receive(&d.mXres, sizeof(int));
+            receive(&d.mYres, sizeof(int));
+            receive(&d.mRArea, sizeof(long long));
+            receive(&d.mVersion, sizeof(int));
+            receive(&d.mCurrentFrame, sizeof(float));
+            receive(&d.mCamFov, sizeof(float));
+            
+            const int camMatrixSize = 16;
+            resizeBuffer(d.mCamMatrixStore, camMatrixSize, mAllocations);
+            receive(&d.mCamMatrixStore[0], sizeof(float)*camMatrixSize);
+            
+            // Whole image, AOVs are named by the buckets
+            d.mSequence = ++mSequence;
+            mFrame = d.mCurrentFrame;
+            mImageId = mServer->newImage(mSession, d.mSequence, ++mGeneration, mFrame);
+            d.mImageId = mImageId;
+            d.mBucket_size_x = d.mXres;
+            d.mBucket_size_y = d.mYres;
+            d.mAovs.clear();
+            mAovs.clear();
+            break;
+        }
+        case 1: // Image data, one AOV
+        {
+            int image_id, spp;
+            receive(&image_id, sizeof(int));
+            receive(&d.mXres, sizeof(int));
+            receive(&d.mYres, sizeof(int));
+            receive(&d.mBucket_xo, sizeof(int));
+            receive(&d.mBucket_yo, sizeof(int));
+            receive(&d.mBucket_size_x, sizeof(int));
+            receive(&d.mBucket_size_y, sizeof(int));
+            receive(&d.mRArea, sizeof(long long));
+            receive(&d.mVersion, sizeof(int));
+            receive(&d.mCurrentFrame, sizeof(float));
+            receive(&spp, sizeof(int));
+            receive(&d.mRam, sizeof(long long));
+            receive(&d.mTime, sizeof(int));
+            if (spp > 4 || !isBucketValid(d, spp))
+                throw std::runtime_error("Unexpected bucket!");
+            
+            // Up to the first null, the last character being one
+            size_t name_size;
+            receive(&name_size, sizeof(size_t));
+            if (name_size == 0 || name_size > static_cast<size_t>(maxAovNameSize))
+                throw std::runtime_error("Unexpected AOV!");
+            std::string name(name_size, '\0');
+            receive(&name[0], name_size);
+            name.resize(std::min(name.find('\0'), name_size - 1));
+            
+            // AOVs join the dictionary as they first show up
+            size_t aov = 0;
+            while (aov < mAovs.size() && mAovs[aov].name != name)
+                ++aov;
+            if (aov == mAovs.size())
+            {
+                if (mAovs.size() >= static_cast<size_t>(maxAovCount))
+                    throw std::runtime_error("Unexpected AOV count!");
+                Aov entry;
+                entry.name = name;
+                entry.spp = spp;
+                mAovs.push_back(entry);
+            }
+            else if (mAovs[aov].spp != spp)
+                throw std::runtime_error("Unexpected AOV!");
+            
+            d.mSequence = ++mSequence;
+            d.mImageId = mImageId;
+            
+            resizeBuffer(d.mPlanes, 1, mAllocations);
+            Plane& plane = d.mPlanes[0];
+            plane.aov = static_cast<int>(aov);
+            plane.spp = spp;
+            plane.precision = Codec::Float;
+            plane.name = mAovs[aov].name.c_str();
+            plane.data = NULL;
+            
+            const int num_samples = d.mBucket_size_x * d.mBucket_size_y * spp;
+            resizeBuffer(d.mPixelStore, num_samples, mAllocations);
+            receive(&d.mPixelStore[0], sizeof(float)*num_samples);
+            
+            if (sink != NULL)
+                sink->write(d, plane, &d.mPixelStore[0]);
+            else
+                plane.data = &d.mPixelStore[0];
+            break;
+        }
+        case 2: // Close image, the Client hangs up next
+        {
+            int image_id;
+            receive(&image_id, sizeof(int));
+            d.mSequence = ++mSequence;
+            d.mImageId = mImageId;
+            break;
+        }
+        default:
+            throw std::runtime_error("Unexpected message!");
+    }
+}
+
+const float* Connection::receivePlane(const PlaneHeader& header,
+                                     float* pixels,
+                                     const int& num_samples,
+                                     const int& spp)
+{
+    const size_t raw_size = sizeof(float) * num_samples;
+    
+    // Nowhere to put them, use the scratch buffer if they can't stay
+    // where they are
+    if (pixels == NULL)
+    {
+        resizeBuffer(mPixels, num_samples, mAllocations);
+        pixels = &mPixels[0];
+    }
+    
+    if (header.codec == Codec::Raw && header.precision == Codec::Float)
+    {
+        if (static_cast<size_t>(header.payloadSize) != raw_size)
+            throw std::runtime_error("Unexpected pixels size!");
+        
+        const float* view = pixels;
+        if (pixels == &mPixels[0])
+            view = reinterpret_cast<const float*>(receiveView(reinterpret_cast<char*>(pixels), raw_size));
+        else
+            receive(pixels, raw_size);
+        
+        if (mCapabilities)
+            mStats.add(raw_size, raw_size, 0);
+        return view;
+    }
+    
+    if (header.payloadSize < 0)
+        throw std::runtime_error("Unexpected pixels size!");
+    
+    // Decoded from where the payload landed
+    const char* packed = NULL;
+    const size_t payload_size = header.payloadSize;
+    if (payload_size > 0)
+    {
+        resizeBuffer(mPayload, payload_size, mAllocations);
+        packed = receiveView(&mPayload[0], payload_size);
+    }
+    return decodePlane(header, packed, pixels, num_samples, spp);
+}
+
+const float* Connection::decodePlane(const PlaneHeader& header,
+                                     const char* packed,
+                                     float* pixels,
+                                     const int& num_samples,
+                                     const int& spp)
+{
+    const size_t raw_size = sizeof(float) * num_samples;
+    const size_t payload_size = header.payloadSize;
+    
+    // Pixels kept as they came
+    if (header.codec == Codec::Raw && header.precision == Codec::Float)
+    {
+        if (payload_size != raw_size)
+            throw std::runtime_error("Unexpected pixels size!");
+        if (raw_size > 0)
+            memcpy(pixels, packed, raw_size);
+        mStats.add(raw_size, raw_size, 0);
+        return pixels;
+    }
+    
+    const ptime start = microsec_clock::universal_time();
+    const size_t packed_size = Codec::packedSize(num_samples, spp, header.precision);
+    const size_t type_size = Codec::typeSize(header.precision);
+    if (type_size == 0)
+        throw std::runtime_error("Unknown pixel precision!");
+    
+    // Decompress straight into the pixels when they are floats
+    if (header.codec == Codec::Raw && payload_size != packed_size)
+        throw std::runtime_error("Unexpected pixels size!");
+    else if (header.codec != Codec::Raw)
+    {
+        char* dst = reinterpret_cast<char*>(pixels);
+        if (header.precision != Codec::Float)
+        {
+            resizeBuffer(mPacked, packed_size, mAllocations);
+            dst = &mPacked[0];
+        }
+        if (!mCodec.decode(header.codec, packed, payload_size,
+                           dst, packed_size, type_size))
+            throw std::runtime_error("Could not decode pixels!");
+        packed = dst;
+    }
+    
+    // Expand back to floats
+    if (header.precision != Codec::Float &&
+        !mCodec.unpack(packed, packed_size, spp, header.precision,
+                       pixels, num_samples))
+        throw std::runtime_error("Could not unpack pixels!");
+    
+    const double us = static_cast<double>((microsec_clock::universal_time() - start).total_microseconds());
+    mStats.add(raw_size, payload_size, us);
+    return pixels;
 }
@@ -8,13 +8,236 @@ All rights reserved. See COPYING.txt for more details.
 #define ATON_SERVER_H_
 
 #include "Data.h"
+#include "Codec.h"
+#include "Ring.h"
+#include "Uring.h"
+#include <set>
+#include <map>
 #include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+class Server;
+
+// Takes the pixels of the buckets as a Connection receives them
+// Lets the parent application write them straight to where they belong,
+// instead of having them copied into the Data returned by listen().
+class BucketSink
+{
+public:
+    virtual ~BucketSink() {}
+    
+    // Called for every plane of a bucket, d holding the bucket header.
+    // pixels holds bucket_size_x * bucket_size_y pixels of plane.spp
+    // interleaved samples, or is NULL if the plane didn't change. It is
+    // only valid during the call. Buckets sent in row strips come one
+    // strip at a time, d holding the rows of the strip.
+    virtual void write(const Data& d, const Plane& plane, const float* pixels) = 0;
+    
+    // Called before write() for every plane that did change, may return
+    // where the Connection should receive the size samples of the plane,
+    // which then come back as the pixels of write(). NULL lets the
+    // Connection keep them in its own buffers.
+    virtual float* buffer(const Data&, const Plane&, const size_t&) { return NULL; }
+};
+
+// One Client connection accepted by a Server
+// A render can open several connections (streams) at once, each one is
+// read by its own thread. Streams of the same render share a session id,
+// and carry sequence numbers so that the image open and close messages,
+// which are sent on all of them, can be applied once and in order.
+// Every image open starts a new generation, numbered by the Client and
+// carried by the buckets. An IPR render restarts the same frame over and
+// over, so buckets of a generation that a newer open of the same frame
+// already replaced are read past without being decoded or returned. The
+// Connection looks for such opens in what it already received and in
+// the other streams of the render.
+class Connection
+{
+friend class Server;
+public:
+    ~Connection();
+    
+    // This function blocks (and so may be require running on a separate thread),
+    // returning once the Client has sent a message. Clients keep their
+    // connection open across images, so it throws once the Client is gone.
+    // The returned Data object is filled with the relevant information and
+    // passed back ready for handling by the parent application.
+    // With a sink, the bucket pixels go to it and the planes of the
+    // returned Data don't point to any.
+    Data listen(BucketSink* sink = NULL);
+    
+    // Same as above, but fills d in place reusing its buffers, so that
+    // a reader that keeps its Data doesn't allocate once they are big
+    // enough
+    void listen(Data& d, BucketSink* sink = NULL);
+    
+    // Wakes up a listen() blocked on this connection
+    void shutdown();
+    
+    // Capabilities and protocol version agreed with the Client
+    const int& capabilities() const { return mCapabilities; }
+    const int& version() const { return mVersion; }
+    
+    // Render this connection belongs to, and which of its streams it is
+    // Single stream Clients get a session of their own from the Server.
+    const long long& session() const { return mSession; }
+    const int& stream() const { return mStream; }
+    const int& streams() const { return mStreams; }
+    
+    // Decompression and precision statistics of the pixels received since resetStats()
+    const CodecStats& stats() const { return mStats; }
+    // Times the receive buffers had to grow since the connection opened
+    long long allocations() const { return mAllocations + mCodec.allocations(); }
+    
+    // Buckets of replaced generations skipped since resetStats()
+    const int& skipped() const { return mSkipped; }
+    void resetStats() { mStats.reset(); mSkipped = 0; }
+    
+private:
+    Connection(Server* server, boost::asio::io_service& ioService);
+    
+    // Reads exactly size bytes from the connected Client, serving them
+    // from the receive buffer first and refilling it in large chunks.
+    // Local Clients are read from the Ring instead, and remote ones from
+    // the chunks of the Uring when the kernel supports it.
+    void receive(void* dst, size_t size);
+    
+    // Reads past size bytes
+    void skip(size_t size);
+    
+    // Copies size bytes found offset bytes past the next one to read, if
+    // they were received already. Waits for nothing, but pulls in what the
+    // socket has when the receive buffer runs out.
+    bool peek(const size_t& offset, void* dst, const size_t& size);
+    
+    // Whether a newer image open of the same frame replaced the bucket
+    // we just read the header of
+    bool isReplaced(const BucketHeader& header);
+    
+    // Reads the planes of a replaced bucket without decoding them, and
+    // keeps them until the same planes come again, in case the Client
+    // says they didn't change then
+    void receiveSkipped(const BucketHeader& header, const int& strip_rows);
+    
+    // Reads one message, returns false if it was a replaced bucket that
+    // got skipped
+    bool receiveMessage(Data& d, BucketSink* sink);
+    
+    // Reads the rest of a message of a Client that opened its image
+    // without a handshake, in the original protocol
+    void receiveLegacy(Data& d, BucketSink* sink);
+    void receiveFromRing(char* dst, size_t size);
+    
+    // Waits for the Client to write to the Ring, idle being the number
+    // of tries that got nothing, and checks it is still there now and then
+    void waitForRing(const int& idle);
+    void receiveFromUring(char*& dst, size_t& size);
+    
+    // Moves on to the next chunk of the Uring. Returns false if the kernel
+    // turned the receive down before any byte came, in which case the
+    // Uring is closed and we go back to reading the socket.
+    bool nextChunk();
+    
+    // Like receive(), but returns where the bytes are instead of copying
+    // them, which is in the receive buffer if they are already there or
+    // fit in it, dst otherwise. Only valid until the next receive.
+    // Pointers into the receive buffer are float aligned.
+    const char* receiveView(char* dst, const size_t& size);
+    
+    // Reads the payload of one plane and expands it to num_samples floats
+    // into pixels, returns where they are. When pixels is NULL they are
+    // left in the receive buffer, or in a scratch buffer.
+    const float* receivePlane(const PlaneHeader& header,
+                              float* pixels,
+                              const int& num_samples,
+                              const int& spp);
+    
+    // Expands the payload of a plane that was already received
+    const float* decodePlane(const PlaneHeader& header,
+                             const char* packed,
+                             float* pixels,
+                             const int& num_samples,
+                             const int& spp);
+    
+    // Reads the sequence number of a message, they only go up
+    void receiveSequence(Data& d);
+    
+    // Whether the Client is still connected, for Clients using the Ring
+    bool isClientAlive();
+    
+    // Server that accepted us
+    Server* mServer;
+    
+    // Capabilities and protocol version agreed with the Client
+    int mCapabilities, mVersion;
+    
+    // Whether the first message came, and whether it was an image open
+    // of a driver from before the handshake
+    bool mGreeted, mLegacy;
+    
+    // Stream of a session
+    long long mSession;
+    int mStream, mStreams, mSequence;
+    
+    // Server id of the current image, and its generation and frame
+    int mImageId, mGeneration;
+    float mFrame;
+    
+    // Bytes read so far, where the message being read ends (version 1
+    // on), how far the messages after it have been looked through, and
+    // where a newer open of the frame was found
+    long long mConsumed, mMessageEnd, mScanned, mReplacedAt;
+    int mSkipped;
+    
+    // Render time of the last bucket skipped, passed on with the next open
+    unsigned int mSkippedTime;
+    
+    // Planes of replaced buckets, per strip, by AOV and bucket position
+    struct SkippedPlane
+    {
+        int strip_rows;
+        std::vector<PlaneHeader> headers;
+        std::vector<char> payload;
+    };
+    std::map<long long, SkippedPlane> mSkippedPlanes;
+    
+    // Planes of the bucket being read that come from mSkippedPlanes
+    std::vector<SkippedPlane*> mRestored;
+    
+    // AOVs of the current image, as declared by the Client
+    std::vector<Aov> mAovs;
+    
+    // Pixel decompression and precision
+    Codec mCodec;
+    CodecStats mStats;
+    std::vector<char> mPacked, mPayload;
+    std::vector<float> mPixels, mExpanded;
+    std::vector<long long> mOffsets;
+    long long mAllocations;
+    
+    // Local transport
+    Ring mRing;
+    
+    // Remote transport on Linux, and the unread range of its current chunk
+    Uring mUring;
+    const char* mChunk;
+    size_t mChunkPos, mChunkEnd;
+    bool mUringChecked;
+    
+    // Receive buffer and the unread range inside it
+    std::vector<char> mBuffer;
+    size_t mBufferPos, mBufferEnd;
+    
+    boost::asio::ip::tcp::socket mSocket;
+};
 
  // Represents a listening Server, ready to accept incoming images
  // This class wraps up the provision of a TCP port, and handles incoming
  // connections from Client objects when they're ready to send image data
 class Server
 {
+friend class Connection;
 public:
     // Creates a new server. By default the Server is not connected at creation time
     Server();
@@ -31,17 +254,22 @@ public:
     // call getPort() afterwards
     void connect(int port, bool search=false);
     
-    // Sets up the server to accept an incoming Client connections.
-    void accept();
-
-    // This function blocks (and so may be require running on a separate thread),
-    // returning once a Client has sent a message.
-    // The returned Data object is filled with the relevant information and
-    // passed back ready for handling by the parent application
-    Data listen();
+    // Blocks until a Client connects and returns its connection, which
+    // stays valid until it is passed to release()
+    Connection* accept();
+    
+    // Closes and deletes a connection returned by accept()
+    void release(Connection* connection);
     
     // This can be used to exit a listening loop running on a separate thread
     void quit();
+    
+    // Wakes up the listen() calls blocked on all the connections
+    void shutdown();
+    
+    // Whether quit() was called, the connection accept() returned last
+    // may be the one it made to wake it up
+    bool isQuitting();
 
     // Returns whether or not the server is connected to a port
     bool isConnected() { return mAcceptor.is_open(); }
@@ -50,12 +278,44 @@ public:
     int getPort() { return mPort; }
 
 private:
+    // Numbers a new single stream render
+    long long newSession();
+    
+    // Numbers the image open of the given sequence number, the streams
+    // of a render all get the same id for it
+    int newImage(const long long& session,
+                 const int& sequence,
+                 const int& generation,
+                 const float& frame);
+    
+    // Generation of the last image open of a session if it is of the
+    // given frame, 0 otherwise
+    int generation(const long long& session, const float& frame);
+    
     // Port we're listening to
     int mPort;
     
+    // Last image open of a session
+    struct ImageOpen
+    {
+        ImageOpen(): sequence(0), id(0), generation(0), frame(0) {}
+        
+        int sequence, id, generation;
+        float frame;
+    };
+    
+    // Last ids handed out, and the last image open of each session
+    long long mSessionCount;
+    int mImageCount;
+    std::map<long long, ImageOpen> mImages;
+    
+    // Open connections, so that quit() can wake them up
+    std::set<Connection*> mConnections;
+    bool mQuitting;
+    boost::mutex mMutex;
+    
     // TCP stuff
     boost::asio::io_service mIoService;
-    boost::asio::ip::tcp::socket mSocket;
     boost::asio::ip::tcp::acceptor mAcceptor;
 };
 
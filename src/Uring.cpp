@@ -0,0 +1,337 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "Uring.h"
+#include <cstring>
+#include <algorithm>
+
+#ifdef __linux__
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+// Multishot receives and buffer rings came with the same kernel headers
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define ATON_URING
+#endif
+
+// Tags of the requests we submit
+static const unsigned long long receiveTag = 1;
+static const unsigned long long cancelTag = 2;
+
+// Buffer group the receive picks its buffers from
+static const unsigned short bufferGroup = 0;
+
+Uring::Uring(): mFd(-1),
+                mSocket(-1),
+                mSqMap(NULL),
+                mCqMap(NULL),
+                mSqes(NULL),
+                mSqMapSize(0),
+                mCqMapSize(0),
+                mSqesSize(0),
+                mSqHead(NULL),
+                mSqTail(NULL),
+                mCqHead(NULL),
+                mCqTail(NULL),
+                mSqArray(NULL),
+                mSqMask(0),
+                mCqMask(0),
+                mCqes(NULL),
+                mBufRing(NULL),
+                mBuffers(NULL),
+                mBufRingSize(0),
+                mBufCount(0),
+                mBufSize(0),
+                mBufTail(0),
+                mCurrent(-1),
+                mArmed(false),
+                mReceived(0)
+{
+}
+
+Uring::~Uring()
+{
+    close();
+}
+
+#ifdef ATON_URING
+
+static int setup(const unsigned& entries, io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int enter(const int& fd, const unsigned& submit, const unsigned& wait)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait,
+                                    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+}
+
+static void* map(const int& fd, const size_t& size, const off_t& offset)
+{
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+bool Uring::open(const int& fd, const size_t& count, const size_t& size)
+{
+    close();
+
+    // Buffer ring entries go by powers of two, and ids are 16 bits
+    if (count == 0 || (count & (count - 1)) != 0 || count > (1 << 15))
+        return false;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    mFd = setup(4, &params);
+    if (mFd < 0)
+    {
+        mFd = -1;
+        return false;
+    }
+
+    // Map the rings, in one go on kernels that allow it
+    mSqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    mCqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+
+    mSqMap = map(mFd, mSqMapSize, IORING_OFF_SQ_RING);
+    if (mSqMap != NULL)
+        mCqMap = params.features & IORING_FEAT_SINGLE_MMAP ? mSqMap : map(mFd, mCqMapSize, IORING_OFF_CQ_RING);
+    mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    if (mCqMap != NULL)
+        mSqes = map(mFd, mSqesSize, IORING_OFF_SQES);
+    if (mSqes == NULL)
+    {
+        close();
+        return false;
+    }
+
+    char* sq = static_cast<char*>(mSqMap);
+    mSqHead = reinterpret_cast<volatile unsigned*>(sq + params.sq_off.head);
+    mSqTail = reinterpret_cast<volatile unsigned*>(sq + params.sq_off.tail);
+    mSqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    mSqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(mCqMap);
+    mCqHead = reinterpret_cast<volatile unsigned*>(cq + params.cq_off.head);
+    mCqTail = reinterpret_cast<volatile unsigned*>(cq + params.cq_off.tail);
+    mCqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    mCqes = cq + params.cq_off.cqes;
+
+    // Buffers, and the ring we hand them to the kernel through
+    mBufCount = count;
+    mBufSize = size;
+    mBufRingSize = count * sizeof(io_uring_buf);
+    mBufRing = mmap(NULL, mBufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mBuffers = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mBufRing == MAP_FAILED || mBuffers == MAP_FAILED)
+    {
+        if (mBufRing == MAP_FAILED)
+            mBufRing = NULL;
+        if (mBuffers == MAP_FAILED)
+            mBuffers = NULL;
+        close();
+        return false;
+    }
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<unsigned long long>(mBufRing);
+    reg.ring_entries = static_cast<unsigned>(count);
+    reg.bgid = bufferGroup;
+    if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        close();
+        return false;
+    }
+
+    mBufTail = 0;
+    for (size_t i = 0; i < count; ++i)
+        recycle(static_cast<int>(i));
+
+    mSocket = fd;
+    if (!arm())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void Uring::close()
+{
+    // Cancel the receive and wait until the kernel let go of the buffers
+    if (mArmed)
+    {
+        const unsigned tail = *mSqTail;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(mSqes) + (tail & mSqMask);
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = receiveTag;
+        sqe->user_data = cancelTag;
+        mSqArray[tail & mSqMask] = tail & mSqMask;
+        __sync_synchronize();
+        *mSqTail = tail + 1;
+
+        enter(mFd, 1, 0);
+        while (mArmed)
+        {
+            unsigned head = *mCqHead;
+            __sync_synchronize();
+            if (head == *mCqTail)
+            {
+                if (enter(mFd, 0, 1) < 0 && errno != EINTR)
+                    break;
+                continue;
+            }
+
+            const io_uring_cqe* cqe = static_cast<io_uring_cqe*>(mCqes) + (head & mCqMask);
+            if (cqe->user_data == receiveTag && !(cqe->flags & IORING_CQE_F_MORE))
+                mArmed = false;
+            __sync_synchronize();
+            *mCqHead = head + 1;
+        }
+    }
+
+    // Closing the ring drops the buffer registration along with it
+    if (mFd >= 0)
+        ::close(mFd);
+    if (mSqes != NULL)
+        munmap(mSqes, mSqesSize);
+    if (mCqMap != NULL && mCqMap != mSqMap)
+        munmap(mCqMap, mCqMapSize);
+    if (mSqMap != NULL)
+        munmap(mSqMap, mSqMapSize);
+    if (mBufRing != NULL)
+        munmap(mBufRing, mBufRingSize);
+    if (mBuffers != NULL)
+        munmap(mBuffers, mBufCount * mBufSize);
+
+    mFd = mSocket = -1;
+    mSqMap = mCqMap = mSqes = mCqes = mBufRing = mBuffers = NULL;
+    mSqHead = mSqTail = mCqHead = mCqTail = NULL;
+    mSqArray = NULL;
+    mCurrent = -1;
+    mArmed = false;
+    mReceived = 0;
+}
+
+bool Uring::arm()
+{
+    const unsigned tail = *mSqTail;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(mSqes) + (tail & mSqMask);
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = mSocket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = bufferGroup;
+    sqe->user_data = receiveTag;
+    mSqArray[tail & mSqMask] = tail & mSqMask;
+
+    // Publish the entry before moving the tail
+    __sync_synchronize();
+    *mSqTail = tail + 1;
+
+    int submitted;
+    do
+        submitted = enter(mFd, 1, 0);
+    while (submitted < 0 && errno == EINTR);
+
+    mArmed = submitted == 1;
+    return mArmed;
+}
+
+void Uring::recycle(const int& id)
+{
+    io_uring_buf* bufs = static_cast<io_uring_buf*>(mBufRing);
+    io_uring_buf* buf = bufs + (mBufTail & (mBufCount - 1));
+    buf->addr = reinterpret_cast<unsigned long long>(static_cast<char*>(mBuffers) + id * mBufSize);
+    buf->len = static_cast<unsigned>(mBufSize);
+    buf->bid = static_cast<unsigned short>(id);
+
+    // Tail lives in the reserved field of the first entry, publish the
+    // entry before moving it
+    __sync_synchronize();
+    *reinterpret_cast<volatile unsigned short*>(reinterpret_cast<char*>(mBufRing) + 14) = ++mBufTail;
+}
+
+long Uring::next(const char*& data)
+{
+    release();
+
+    while (true)
+    {
+        unsigned head = *mCqHead;
+
+        // See what the kernel completed before reading it
+        __sync_synchronize();
+        if (head == *mCqTail)
+        {
+            // Ran out of buffers before we gave one back, start over
+            if (!mArmed && !arm())
+                return -EIO;
+
+            if (enter(mFd, 0, 1) < 0 && errno != EINTR)
+                return -errno;
+            continue;
+        }
+
+        const io_uring_cqe* cqe = static_cast<io_uring_cqe*>(mCqes) + (head & mCqMask);
+        const unsigned long long tag = cqe->user_data;
+        const int res = cqe->res;
+        const unsigned flags = cqe->flags;
+
+        // Done with the entry before handing it back
+        __sync_synchronize();
+        *mCqHead = head + 1;
+
+        if (tag != receiveTag)
+            continue;
+        if (!(flags & IORING_CQE_F_MORE))
+            mArmed = false;
+
+        if (res == -ENOBUFS)
+            continue;
+        if (res <= 0)
+            return res;
+
+        mCurrent = static_cast<int>(flags >> IORING_CQE_BUFFER_SHIFT);
+        data = static_cast<const char*>(mBuffers) + mCurrent * mBufSize;
+        mReceived += res;
+        return res;
+    }
+}
+
+void Uring::release()
+{
+    if (mCurrent >= 0)
+        recycle(mCurrent);
+    mCurrent = -1;
+}
+
+#else
+
+bool Uring::open(const int& fd, const size_t& count, const size_t& size) { return false; }
+void Uring::close() {}
+bool Uring::arm() { return false; }
+void Uring::recycle(const int& id) {}
+long Uring::next(const char*& data) { return -1; }
+void Uring::release() {}
+
+#endif
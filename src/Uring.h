@@ -0,0 +1,76 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_URING_H_
+#define ATON_URING_H_
+
+#include <cstddef>
+
+// Receives from a socket through Linux io_uring
+// A Uring keeps a single multishot receive armed on the socket, which the
+// kernel completes into a fixed pool of buffers registered with it up
+// front. Every free buffer is a receive in flight, so the kernel keeps
+// filling them while the caller parses, and the caller reads the bytes
+// where the kernel put them. Completions come in the order the bytes
+// arrived on the socket.
+// Needs a 6.0 kernel, open() fails on older ones and on other systems.
+class Uring
+{
+public:
+    Uring();
+
+    // Stops receiving and frees the buffers
+    ~Uring();
+
+    // Starts receiving from the socket fd into count buffers of size bytes
+    bool open(const int& fd, const size_t& count, const size_t& size);
+
+    // Stops receiving and frees the buffers
+    void close();
+
+    // Waits for the next chunk received from the socket, which stays
+    // valid until release(). Returns its size, 0 once the other side
+    // closed the socket, or a negative errno.
+    long next(const char*& data);
+
+    // Gives the buffer of the last chunk back to the kernel
+    void release();
+
+    bool isOpen() const { return mFd >= 0; }
+
+    // Bytes received since open()
+    const long long& received() const { return mReceived; }
+
+private:
+    // Queues the multishot receive and submits it
+    bool arm();
+
+    // Hands buffer id back to the kernel
+    void recycle(const int& id);
+
+    int mFd, mSocket;
+
+    // Submission and completion rings, shared with the kernel
+    void *mSqMap, *mCqMap, *mSqes;
+    size_t mSqMapSize, mCqMapSize, mSqesSize;
+    volatile unsigned *mSqHead, *mSqTail, *mCqHead, *mCqTail;
+    unsigned *mSqArray, mSqMask, mCqMask;
+    void* mCqes;
+
+    // Buffer ring and the buffers it points to
+    void *mBufRing, *mBuffers;
+    size_t mBufRingSize, mBufCount, mBufSize;
+    unsigned short mBufTail;
+
+    // Buffer of the chunk handed out by next(), if any
+    int mCurrent;
+
+    // Whether the receive is still armed in the kernel
+    bool mArmed;
+    long long mReceived;
+};
+
+#endif // ATON_URING_H_